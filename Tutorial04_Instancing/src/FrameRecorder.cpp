@@ -0,0 +1,702 @@
+/*
+ *  Copyright 2019-2024 Diligent Graphics LLC
+ *  Copyright 2015-2019 Egor Yusov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  In no event and under no legal theory, whether in tort (including negligence),
+ *  contract, or otherwise, unless required by applicable law (such as deliberate
+ *  and grossly negligent acts) or agreed to in writing, shall any Contributor be
+ *  liable for any damages, including any direct, indirect, special, incidental,
+ *  or consequential damages of any character arising as a result of this License or
+ *  out of the use or inability to use the software (including but not limited to damages
+ *  for loss of goodwill, work stoppage, computer failure or malfunction, or any and
+ *  all other commercial damages or losses), even if such Contributor has been advised
+ *  of the possibility of such damages.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#include "FrameRecorder.hpp"
+#include "Image.h"
+#include "FileSystem.hpp"
+#include "DataBlob.h"
+#include "Errors.hpp"
+
+namespace Diligent
+{
+
+namespace
+{
+
+// Paleta fija de 6x7x6 niveles (252 colores) para el GIF. Evita tener que
+// calcular una paleta por fotograma y permite codificar cada uno por separado.
+constexpr Uint32 GifLevelsR = 6;
+constexpr Uint32 GifLevelsG = 7;
+constexpr Uint32 GifLevelsB = 6;
+
+// Los navegadores y la mayoría de visores tratan los retardos menores como 10
+constexpr Uint32 MinGifDelay = 2;
+
+inline Uint8 GifPaletteIndex(Uint8 R, Uint8 G, Uint8 B)
+{
+    const Uint32 r = (R * (GifLevelsR - 1) + 127) / 255;
+    const Uint32 g = (G * (GifLevelsG - 1) + 127) / 255;
+    const Uint32 b = (B * (GifLevelsB - 1) + 127) / 255;
+    return static_cast<Uint8>((r * GifLevelsG + g) * GifLevelsB + b);
+}
+
+void WriteLE16(std::vector<Uint8>& Out, Uint32 Value)
+{
+    Out.push_back(static_cast<Uint8>(Value & 0xFF));
+    Out.push_back(static_cast<Uint8>((Value >> 8) & 0xFF));
+}
+
+// Compresión LZW de GIF con códigos de tamaño variable (9 a 12 bits).
+// El diccionario es una tabla hash con direccionamiento abierto, de modo que
+// vaciarlo al llenarse es barato.
+void GifLzwEncode(const std::vector<Uint8>& Indices, std::vector<Uint8>& Out)
+{
+    constexpr Uint32 MinCodeSize = 8;
+    constexpr Uint32 ClearCode   = 1u << MinCodeSize;
+    constexpr Uint32 EndCode     = ClearCode + 1;
+    constexpr Uint32 MaxDictCode = 4095;
+    constexpr Uint32 HashBits    = 13;
+    constexpr Uint32 HashSize    = 1u << HashBits;
+    constexpr Uint32 EmptyKey    = ~0u;
+
+    std::vector<Uint32> HashKeys(HashSize, EmptyKey);
+    std::vector<Uint16> HashCodes(HashSize);
+
+    std::vector<Uint8> Bytes;
+    Bytes.reserve(Indices.size() / 2);
+    Uint32 BitBuffer = 0;
+    Uint32 BitCount  = 0;
+    Uint32 CodeSize  = MinCodeSize + 1;
+    Uint32 MaxCode   = EndCode;
+
+    auto PutCode = [&](Uint32 Code) {
+        BitBuffer |= Code << BitCount;
+        BitCount += CodeSize;
+        while (BitCount >= 8)
+        {
+            Bytes.push_back(static_cast<Uint8>(BitBuffer & 0xFF));
+            BitBuffer >>= 8;
+            BitCount -= 8;
+        }
+    };
+
+    auto HashSlot = [&](Uint32 Key) {
+        return (Key * 2654435761u) >> (32 - HashBits);
+    };
+
+    PutCode(ClearCode);
+    Uint32 Prefix = Indices.empty() ? 0 : Indices[0];
+    for (size_t i = 1; i < Indices.size(); ++i)
+    {
+        const Uint32 Key  = (Prefix << 8) | Indices[i];
+        Uint32       Slot = HashSlot(Key);
+        while (HashKeys[Slot] != EmptyKey && HashKeys[Slot] != Key)
+            Slot = (Slot + 1) & (HashSize - 1);
+
+        if (HashKeys[Slot] == Key)
+        {
+            Prefix = HashCodes[Slot];
+            continue;
+        }
+
+        PutCode(Prefix);
+
+        HashKeys[Slot]  = Key;
+        HashCodes[Slot] = static_cast<Uint16>(++MaxCode);
+        if (MaxCode >= (1u << CodeSize))
+            ++CodeSize;
+        if (MaxCode == MaxDictCode)
+        {
+            // Diccionario lleno: se vacía y se empieza de nuevo
+            PutCode(ClearCode);
+            std::fill(HashKeys.begin(), HashKeys.end(), EmptyKey);
+            CodeSize = MinCodeSize + 1;
+            MaxCode  = EndCode;
+        }
+
+        Prefix = Indices[i];
+    }
+    PutCode(Prefix);
+    PutCode(EndCode);
+    if (BitCount > 0)
+        Bytes.push_back(static_cast<Uint8>(BitBuffer & 0xFF));
+
+    // Los datos se escriben en sub-bloques de 255 bytes como máximo
+    Out.push_back(static_cast<Uint8>(MinCodeSize));
+    for (size_t Offset = 0; Offset < Bytes.size(); Offset += 255)
+    {
+        const size_t BlockSize = std::min<size_t>(255, Bytes.size() - Offset);
+        Out.push_back(static_cast<Uint8>(BlockSize));
+        Out.insert(Out.end(), Bytes.begin() + Offset, Bytes.begin() + Offset + BlockSize);
+    }
+    Out.push_back(0);
+}
+
+} // namespace
+
+FrameRecorder::~FrameRecorder()
+{
+    VERIFY(!m_IsRecording, "Stop() must be called before the recorder is destroyed");
+    if (!m_Workers.empty())
+    {
+        {
+            std::lock_guard<std::mutex> Lock{m_JobsMtx};
+            m_StopWorkers = true;
+        }
+        m_JobsCV.notify_all();
+        for (auto& Worker : m_Workers)
+            Worker.join();
+    }
+}
+
+bool FrameRecorder::Start(const StartInfo& Info)
+{
+    if (m_IsRecording)
+        return false;
+
+    // Sin este uso la copia del back buffer no es válida (p. ej. en Vulkan y Metal)
+    if ((Info.Usage & SWAP_CHAIN_USAGE_COPY_SOURCE) == 0)
+    {
+        LOG_ERROR_MESSAGE("Frame recorder: the swap chain was not created with SWAP_CHAIN_USAGE_COPY_SOURCE");
+        return false;
+    }
+
+    switch (Info.Format)
+    {
+        case TEX_FORMAT_RGBA8_UNORM:
+        case TEX_FORMAT_RGBA8_UNORM_SRGB:
+            m_IsBGRA = false;
+            break;
+
+        case TEX_FORMAT_BGRA8_UNORM:
+        case TEX_FORMAT_BGRA8_UNORM_SRGB:
+            m_IsBGRA = true;
+            break;
+
+        default:
+            LOG_ERROR_MESSAGE("Frame recorder: unsupported back buffer format ", GetTextureFormatAttribs(Info.Format).Name);
+            return false;
+    }
+
+    m_Info           = Info;
+    m_Info.Downscale = std::max(m_Info.Downscale, 1u);
+    m_Info.RingSize  = std::max(m_Info.RingSize, 2u);
+    // En OpenGL la imagen leída está invertida verticalmente
+    m_FlipY = Info.pDevice->GetDeviceInfo().IsGLDevice();
+
+    FenceDesc FenceCI;
+    FenceCI.Name = "Frame recorder fence";
+    FenceCI.Type = FENCE_TYPE_CPU_WAIT_ONLY;
+    m_pFence.Release();
+    Info.pDevice->CreateFence(FenceCI, &m_pFence);
+    m_NextFenceValue = 1;
+
+    if (!CreateStagingRing(m_Info.Width, m_Info.Height))
+        return false;
+    m_NextFrameIdx        = 0;
+    m_CaptureDroppedTime  = 0;
+    m_ReadBackDroppedTime = 0;
+
+    FileSystem::CreateDirectory(m_Info.Directory.c_str());
+    if (m_Info.Output == OutputFormat::Gif)
+    {
+        const std::string Path = m_Info.Directory + "/capture.gif";
+        m_GifFile.open(Path, std::ios::binary | std::ios::trunc);
+        if (!m_GifFile)
+        {
+            LOG_ERROR_MESSAGE("Frame recorder: failed to create ", Path);
+            m_Ring.clear();
+            return false;
+        }
+        m_PendingGifFrames.clear();
+        m_NextGifFrame = 0;
+        WriteGifHeader();
+    }
+    else
+    {
+        const std::string Path = m_Info.Directory + "/frames.ffconcat";
+        m_PngTimingFile.open(Path, std::ios::trunc);
+        if (!m_PngTimingFile)
+        {
+            LOG_ERROR_MESSAGE("Frame recorder: failed to create ", Path);
+            m_Ring.clear();
+            return false;
+        }
+        m_PngTimingFile << "ffconcat version 1.0\n";
+    }
+    m_LastFrameTime = 0;
+    m_HeldGifJob    = EncodeJob{};
+    m_HasHeldGifJob = false;
+
+    m_CapturedFrames = 0;
+    m_EncodedFrames  = 0;
+    m_DroppedFrames  = 0;
+    m_MergedFrames   = 0;
+    m_GifDelayCarry  = 0;
+    m_CaptureTime    = 0;
+    m_AvgCaptureTime = 0;
+    m_AvgGpuCopyTime = 0;
+
+    m_pCopyDurationQuery.reset();
+    if (Info.pDevice->GetDeviceInfo().Features.DurationQueries)
+        m_pCopyDurationQuery.reset(new DurationQueryHelper{Info.pDevice, m_Info.RingSize});
+
+    Uint32 NumWorkers = m_Info.NumWorkers;
+    if (NumWorkers == 0)
+        NumWorkers = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+    m_StopWorkers = false;
+    for (Uint32 i = 0; i < NumWorkers; ++i)
+        m_Workers.emplace_back(&FrameRecorder::WorkerThread, this);
+
+    m_IsRecording = true;
+    return true;
+}
+
+bool FrameRecorder::CreateStagingRing(Uint32 Width, Uint32 Height)
+{
+    m_Info.Width  = Width;
+    m_Info.Height = Height;
+    m_OutWidth    = Width / m_Info.Downscale;
+    m_OutHeight   = Height / m_Info.Downscale;
+
+    TextureDesc StagingDesc;
+    StagingDesc.Name           = "Frame recorder staging texture";
+    StagingDesc.Type           = RESOURCE_DIM_TEX_2D;
+    StagingDesc.Width          = Width;
+    StagingDesc.Height         = Height;
+    StagingDesc.Format         = m_Info.Format;
+    StagingDesc.Usage          = USAGE_STAGING;
+    StagingDesc.CPUAccessFlags = CPU_ACCESS_READ;
+
+    m_Ring.clear();
+    m_Ring.resize(m_Info.RingSize);
+    for (auto& Slot : m_Ring)
+    {
+        m_Info.pDevice->CreateTexture(StagingDesc, nullptr, &Slot.pTexture);
+        if (!Slot.pTexture)
+        {
+            LOG_ERROR_MESSAGE("Frame recorder: failed to create ", Width, "x", Height, " staging texture");
+            m_Ring.clear();
+            return false;
+        }
+    }
+    m_NextSlot   = 0;
+    m_OldestSlot = 0;
+    return true;
+}
+
+void FrameRecorder::Stop(IDeviceContext* pContext)
+{
+    if (!m_IsRecording)
+        return;
+
+    // Al detener la grabación sí se espera a las copias que quedan en vuelo
+    ReadBackCompleted(pContext, true);
+
+    if (m_HasHeldGifJob)
+    {
+        // No hay fotograma siguiente: el último usa la duración del intervalo anterior
+        const double GifDelayExact = m_GifDelayCarry + m_LastFrameTime * 100.0;
+        m_HeldGifJob.GifDelay      = std::min(std::max(static_cast<Uint32>(GifDelayExact + 0.5), MinGifDelay), 0xFFFFu);
+        SubmitJob(std::move(m_HeldGifJob));
+        m_HasHeldGifJob = false;
+    }
+
+    {
+        std::lock_guard<std::mutex> Lock{m_JobsMtx};
+        m_StopWorkers = true;
+    }
+    m_JobsCV.notify_all();
+    for (auto& Worker : m_Workers)
+        Worker.join();
+    m_Workers.clear();
+
+    if (m_GifFile.is_open())
+    {
+        VERIFY(m_PendingGifFrames.empty(), "All GIF frames must have been written");
+        m_GifFile.put(0x3B); // Trailer
+        m_GifFile.close();
+    }
+
+    if (m_PngTimingFile.is_open())
+    {
+        // No hay fotograma siguiente: el último usa la duración del intervalo anterior
+        if (m_NextFrameIdx > 0)
+            WritePngDuration(m_NextFrameIdx - 1, m_LastFrameTime);
+        m_PngTimingFile.close();
+    }
+
+    m_Ring.clear();
+    m_pFence.Release();
+    m_pCopyDurationQuery.reset();
+    m_IsRecording = false;
+}
+
+void FrameRecorder::CaptureFrame(IDeviceContext* pContext, ITexture* pBackBuffer, double FrameTime)
+{
+    if (!m_IsRecording)
+        return;
+
+    const auto StartTime = std::chrono::high_resolution_clock::now();
+
+    const auto& BBDesc = pBackBuffer->GetDesc();
+    if (BBDesc.Width != m_Info.Width || BBDesc.Height != m_Info.Height)
+    {
+        // La ventana ha cambiado de tamaño. Las dimensiones del GIF están fijadas en la
+        // cabecera, así que la grabación termina; la secuencia PNG continúa con el nuevo
+        // tamaño tras leer las copias que quedan en vuelo con el tamaño anterior
+        if (m_Info.Output == OutputFormat::Gif)
+        {
+            LOG_ERROR_MESSAGE("Frame recorder: the window was resized to ", BBDesc.Width, "x", BBDesc.Height,
+                              ", which a GIF recording does not support. Recording stopped.");
+            Stop(pContext);
+            return;
+        }
+
+        ReadBackCompleted(pContext, true);
+        if (!CreateStagingRing(BBDesc.Width, BBDesc.Height))
+        {
+            LOG_ERROR_MESSAGE("Frame recorder: recording stopped");
+            Stop(pContext);
+            return;
+        }
+    }
+
+    // Primero recogemos las copias que la GPU ya ha terminado, sin esperar
+    ReadBackCompleted(pContext, false);
+
+    StagingSlot& Slot = m_Ring[m_NextSlot];
+    if (Slot.InFlight)
+    {
+        // No hay textura libre: se descarta
+        ++m_DroppedFrames;
+        m_CaptureDroppedTime += FrameTime;
+    }
+    else
+    {
+        if (m_pCopyDurationQuery)
+            m_pCopyDurationQuery->Begin(pContext);
+
+        CopyTextureAttribs CopyAttribs{pBackBuffer, RESOURCE_STATE_TRANSITION_MODE_TRANSITION,
+                                       Slot.pTexture, RESOURCE_STATE_TRANSITION_MODE_TRANSITION};
+        pContext->CopyTexture(CopyAttribs);
+
+        double GpuCopyTime = 0;
+        if (m_pCopyDurationQuery && m_pCopyDurationQuery->End(pContext, GpuCopyTime))
+            m_AvgGpuCopyTime = m_AvgGpuCopyTime > 0 ? m_AvgGpuCopyTime * 0.95 + GpuCopyTime * 0.05 : GpuCopyTime;
+
+        Slot.FenceValue = m_NextFenceValue++;
+        pContext->EnqueueSignal(m_pFence, Slot.FenceValue);
+        Slot.FrameTime       = FrameTime + m_CaptureDroppedTime;
+        Slot.InFlight        = true;
+        m_CaptureDroppedTime = 0;
+        m_NextSlot           = (m_NextSlot + 1) % static_cast<Uint32>(m_Ring.size());
+        ++m_CapturedFrames;
+    }
+
+    const auto EndTime = std::chrono::high_resolution_clock::now();
+    m_CaptureTime      = std::chrono::duration<double>(EndTime - StartTime).count();
+    m_AvgCaptureTime   = m_AvgCaptureTime > 0 ? m_AvgCaptureTime * 0.95 + m_CaptureTime * 0.05 : m_CaptureTime;
+}
+
+void FrameRecorder::ReadBackCompleted(IDeviceContext* pContext, bool Wait)
+{
+    if (m_Ring.empty())
+        return;
+
+    // Las copias se completan en el mismo orden en que se enviaron
+    const Uint64 CompletedValue = m_pFence->GetCompletedValue();
+    while (m_Ring[m_OldestSlot].InFlight)
+    {
+        StagingSlot& Slot = m_Ring[m_OldestSlot];
+        if (Slot.FenceValue > CompletedValue)
+        {
+            if (!Wait)
+                break;
+            pContext->WaitForFence(m_pFence, Slot.FenceValue, true);
+        }
+
+        ReadBackSlot(pContext, Slot);
+        Slot.InFlight = false;
+        m_OldestSlot  = (m_OldestSlot + 1) % static_cast<Uint32>(m_Ring.size());
+    }
+}
+
+void FrameRecorder::ReadBackSlot(IDeviceContext* pContext, StagingSlot& Slot)
+{
+    {
+        // Si los hilos no dan abasto, descartamos el fotograma en lugar de acumular memoria
+        std::lock_guard<std::mutex> Lock{m_JobsMtx};
+        if (m_Jobs.size() >= m_Info.MaxQueuedJobs)
+        {
+            ++m_DroppedFrames;
+            m_ReadBackDroppedTime += Slot.FrameTime;
+            return;
+        }
+    }
+
+    // Tiempo desde el último fotograma guardado, es decir, lo que ese fotograma permanece
+    // en pantalla (incluidos los fotogramas descartados entre ambos)
+    const double FrameTime = Slot.FrameTime + m_ReadBackDroppedTime;
+
+    // Este intervalo es el retardo del fotograma del GIF retenido. Se calcula aquí porque los
+    // fotogramas llegan en orden. Se mide en centésimas de segundo y la parte fraccionaria se
+    // arrastra al siguiente fotograma para que la duración total coincida. Los visores ignoran
+    // retardos menores de 2, así que por encima de 50 FPS este fotograma se fusiona con el
+    // retenido (que sigue en pantalla más tiempo) en lugar de alargarse
+    double GifDelayExact = 0;
+    Uint32 GifDelay      = 0;
+    if (m_HasHeldGifJob)
+    {
+        GifDelayExact = m_GifDelayCarry + FrameTime * 100.0;
+        GifDelay      = std::min(static_cast<Uint32>(GifDelayExact + 0.5), 0xFFFFu);
+        if (GifDelay < MinGifDelay)
+        {
+            m_ReadBackDroppedTime = FrameTime;
+            ++m_MergedFrames;
+            return;
+        }
+    }
+
+    MappedTextureSubresource MappedData;
+    pContext->MapTextureSubresource(Slot.pTexture, 0, 0, MAP_READ, MAP_FLAG_DO_NOT_WAIT, nullptr, MappedData);
+    if (MappedData.pData == nullptr)
+    {
+        ++m_DroppedFrames;
+        m_ReadBackDroppedTime = FrameTime;
+        return;
+    }
+
+    // En el hilo de render solo se copian las filas necesarias; la conversión de
+    // formato, la reducción horizontal y la codificación se hacen en los hilos de trabajo
+    m_ReadBackDroppedTime = 0;
+    m_LastFrameTime       = FrameTime;
+    if (m_PngTimingFile.is_open())
+    {
+        // El fotograma anterior se muestra hasta que llega este, así que su duración es
+        // FrameTime. Se escribe aquí, en el hilo de render, para mantener el orden
+        if (m_NextFrameIdx > 0)
+            WritePngDuration(m_NextFrameIdx - 1, FrameTime);
+    }
+
+    EncodeJob Job;
+    Job.FrameIdx  = m_NextFrameIdx++;
+    Job.SrcWidth  = m_Info.Width;
+    Job.OutWidth  = m_OutWidth;
+    Job.OutHeight = m_OutHeight;
+
+    const size_t RowSize = size_t{m_Info.Width} * 4;
+    Job.Pixels.resize(RowSize * m_OutHeight);
+    const Uint8* pSrc = static_cast<const Uint8*>(MappedData.pData);
+    for (Uint32 y = 0; y < m_OutHeight; ++y)
+        memcpy(&Job.Pixels[RowSize * y], pSrc + size_t{MappedData.Stride} * y * m_Info.Downscale, RowSize);
+
+    pContext->UnmapTextureSubresource(Slot.pTexture, 0, 0);
+
+    if (m_Info.Output != OutputFormat::Gif)
+    {
+        SubmitJob(std::move(Job));
+        return;
+    }
+
+    // Ya se conoce el retardo del fotograma retenido; este queda retenido hasta el siguiente
+    if (m_HasHeldGifJob)
+    {
+        m_HeldGifJob.GifDelay = GifDelay;
+        m_GifDelayCarry       = GifDelayExact - GifDelay;
+        SubmitJob(std::move(m_HeldGifJob));
+    }
+    m_HeldGifJob    = std::move(Job);
+    m_HasHeldGifJob = true;
+}
+
+void FrameRecorder::SubmitJob(EncodeJob&& Job)
+{
+    {
+        std::lock_guard<std::mutex> Lock{m_JobsMtx};
+        m_Jobs.emplace_back(std::move(Job));
+    }
+    m_JobsCV.notify_one();
+}
+
+void FrameRecorder::WritePngDuration(Uint32 FrameIdx, double Duration)
+{
+    char Entry[64];
+    snprintf(Entry, sizeof(Entry), "file 'frame_%05u.png'\nduration %.6f\n", FrameIdx, Duration);
+    m_PngTimingFile << Entry;
+}
+
+void FrameRecorder::WorkerThread()
+{
+    for (;;)
+    {
+        EncodeJob Job;
+        {
+            std::unique_lock<std::mutex> Lock{m_JobsMtx};
+            m_JobsCV.wait(Lock, [this]() { return m_StopWorkers || !m_Jobs.empty(); });
+            // Al detener se terminan de codificar los trabajos pendientes
+            if (m_Jobs.empty())
+                return;
+            Job = std::move(m_Jobs.front());
+            m_Jobs.pop_front();
+        }
+
+        ConvertPixels(Job);
+        if (m_Info.Output == OutputFormat::Gif)
+            EncodeGifFrame(Job);
+        else
+            EncodePng(Job);
+        ++m_EncodedFrames;
+    }
+}
+
+void FrameRecorder::ConvertPixels(EncodeJob& Job) const
+{
+    // Convierte las filas del back buffer a RGBA8 compacto de OutWidth x OutHeight:
+    // reduce en horizontal, intercambia R y B si hace falta e invierte en vertical en OpenGL
+    const size_t       SrcRowSize = size_t{Job.SrcWidth} * 4;
+    std::vector<Uint8> Dst(size_t{Job.OutWidth} * Job.OutHeight * 4);
+    for (Uint32 y = 0; y < Job.OutHeight; ++y)
+    {
+        const Uint32 SrcRow = m_FlipY ? Job.OutHeight - 1 - y : y;
+        const Uint8* pSrc   = &Job.Pixels[SrcRowSize * SrcRow];
+        Uint8*       pDst   = &Dst[size_t{Job.OutWidth} * 4 * y];
+        for (Uint32 x = 0; x < Job.OutWidth; ++x)
+        {
+            const Uint8* pTexel = pSrc + size_t{x} * m_Info.Downscale * 4;
+            pDst[x * 4 + 0]     = m_IsBGRA ? pTexel[2] : pTexel[0];
+            pDst[x * 4 + 1]     = pTexel[1];
+            pDst[x * 4 + 2]     = m_IsBGRA ? pTexel[0] : pTexel[2];
+            pDst[x * 4 + 3]     = 255;
+        }
+    }
+    Job.Pixels = std::move(Dst);
+}
+
+void FrameRecorder::EncodePng(const EncodeJob& Job)
+{
+    Image::EncodeInfo Info;
+    Info.Width      = Job.OutWidth;
+    Info.Height     = Job.OutHeight;
+    Info.TexFormat  = TEX_FORMAT_RGBA8_UNORM;
+    Info.KeepAlpha  = false;
+    Info.pData      = Job.Pixels.data();
+    Info.Stride     = Job.OutWidth * 4;
+    Info.FileFormat = IMAGE_FILE_FORMAT_PNG;
+
+    RefCntAutoPtr<IDataBlob> pEncodedImage;
+    Image::Encode(Info, &pEncodedImage);
+    if (!pEncodedImage)
+    {
+        LOG_ERROR_MESSAGE("Frame recorder: failed to encode frame ", Job.FrameIdx);
+        return;
+    }
+
+    char FileName[32];
+    snprintf(FileName, sizeof(FileName), "/frame_%05u.png", Job.FrameIdx);
+    std::ofstream File{m_Info.Directory + FileName, std::ios::binary | std::ios::trunc};
+    File.write(static_cast<const char*>(pEncodedImage->GetConstDataPtr()), static_cast<std::streamsize>(pEncodedImage->GetSize()));
+}
+
+void FrameRecorder::WriteGifHeader()
+{
+    std::vector<Uint8> Header;
+    const char         Signature[] = "GIF89a";
+    Header.insert(Header.end(), Signature, Signature + 6);
+
+    // Logical screen descriptor con paleta global de 256 entradas
+    WriteLE16(Header, m_OutWidth);
+    WriteLE16(Header, m_OutHeight);
+    Header.push_back(0xF7);
+    Header.push_back(0); // Color de fondo
+    Header.push_back(0); // Relación de aspecto
+
+    for (Uint32 i = 0; i < 256; ++i)
+    {
+        Uint8 RGB[3] = {};
+        if (i < GifLevelsR * GifLevelsG * GifLevelsB)
+        {
+            RGB[0] = static_cast<Uint8>((i / (GifLevelsG * GifLevelsB)) * 255 / (GifLevelsR - 1));
+            RGB[1] = static_cast<Uint8>(((i / GifLevelsB) % GifLevelsG) * 255 / (GifLevelsG - 1));
+            RGB[2] = static_cast<Uint8>((i % GifLevelsB) * 255 / (GifLevelsB - 1));
+        }
+        Header.insert(Header.end(), RGB, RGB + 3);
+    }
+
+    // Extensión NETSCAPE2.0 para que la animación se repita indefinidamente
+    const Uint8 Loop[] = {0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00};
+    Header.insert(Header.end(), Loop, Loop + sizeof(Loop));
+
+    m_GifFile.write(reinterpret_cast<const char*>(Header.data()), static_cast<std::streamsize>(Header.size()));
+}
+
+void FrameRecorder::EncodeGifFrame(const EncodeJob& Job)
+{
+    std::vector<Uint8> Indices(size_t{Job.OutWidth} * Job.OutHeight);
+    for (size_t i = 0; i < Indices.size(); ++i)
+        Indices[i] = GifPaletteIndex(Job.Pixels[i * 4 + 0], Job.Pixels[i * 4 + 1], Job.Pixels[i * 4 + 2]);
+
+    std::vector<Uint8> Block;
+    Block.reserve(Indices.size() / 2);
+
+    // Graphic control extension: retardo en centésimas de segundo
+    Block.insert(Block.end(), {0x21, 0xF9, 0x04, 0x00});
+    WriteLE16(Block, Job.GifDelay);
+    Block.insert(Block.end(), {0x00, 0x00});
+
+    // Image descriptor: imagen completa, sin paleta local
+    Block.push_back(0x2C);
+    WriteLE16(Block, 0);
+    WriteLE16(Block, 0);
+    WriteLE16(Block, Job.OutWidth);
+    WriteLE16(Block, Job.OutHeight);
+    Block.push_back(0x00);
+
+    GifLzwEncode(Indices, Block);
+
+    // Cada hilo codifica su fotograma por separado; se escriben en orden
+    std::lock_guard<std::mutex> Lock{m_GifMtx};
+    m_PendingGifFrames.emplace(Job.FrameIdx, std::move(Block));
+    for (auto It = m_PendingGifFrames.find(m_NextGifFrame); It != m_PendingGifFrames.end(); It = m_PendingGifFrames.find(m_NextGifFrame))
+    {
+        m_GifFile.write(reinterpret_cast<const char*>(It->second.data()), static_cast<std::streamsize>(It->second.size()));
+        m_PendingGifFrames.erase(It);
+        ++m_NextGifFrame;
+    }
+}
+
+FrameRecorder::Statistics FrameRecorder::GetStatistics() const
+{
+    Statistics Stats;
+    Stats.CapturedFrames = m_CapturedFrames;
+    Stats.EncodedFrames  = m_EncodedFrames;
+    Stats.DroppedFrames  = m_DroppedFrames;
+    Stats.MergedFrames   = m_MergedFrames;
+    Stats.CaptureTime    = m_CaptureTime;
+    Stats.AvgCaptureTime = m_AvgCaptureTime;
+    Stats.AvgGpuCopyTime = m_AvgGpuCopyTime;
+
+    Stats.GpuTimingAvailable = m_pCopyDurationQuery != nullptr;
+    return Stats;
+}
+
+} // namespace Diligent
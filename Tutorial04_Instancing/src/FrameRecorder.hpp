@@ -0,0 +1,212 @@
+/*
+ *  Copyright 2019-2024 Diligent Graphics LLC
+ *  Copyright 2015-2019 Egor Yusov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  In no event and under no legal theory, whether in tort (including negligence),
+ *  contract, or otherwise, unless required by applicable law (such as deliberate
+ *  and grossly negligent acts) or agreed to in writing, shall any Contributor be
+ *  liable for any damages, including any direct, indirect, special, incidental,
+ *  or consequential damages of any character arising as a result of this License or
+ *  out of the use or inability to use the software (including but not limited to damages
+ *  for loss of goodwill, work stoppage, computer failure or malfunction, or any and
+ *  all other commercial damages or losses), even if such Contributor has been advised
+ *  of the possibility of such damages.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <fstream>
+#include <memory>
+
+#include "RenderDevice.h"
+#include "DeviceContext.h"
+#include "Texture.h"
+#include "SwapChain.h"
+#include "Fence.h"
+#include "RefCntAutoPtr.hpp"
+#include "DurationQueryHelper.hpp"
+
+namespace Diligent
+{
+
+// Grabación de fotogramas sin detener el renderizado.
+// Cada fotograma se copia del back buffer a una textura de un anillo de texturas
+// staging y se marca con una fence. En los fotogramas siguientes, las copias cuya
+// fence ya se ha completado se leen sin esperar y se pasan a hilos de trabajo que
+// las codifican como secuencia PNG o como GIF animado.
+// La secuencia PNG se numera sin huecos; la duración real de cada fotograma (que
+// incluye el tiempo de los fotogramas descartados) se escribe en frames.ffconcat,
+// que ffmpeg acepta directamente: ffmpeg -f concat -i frames.ffconcat video.mp4
+// En el GIF esa misma duración es el retardo del fotograma, así que cada fotograma se
+// retiene hasta que llega el siguiente y solo entonces se pasa a los hilos.
+// Si no queda ninguna textura libre en el anillo, o los hilos no dan abasto,
+// el fotograma se descarta en lugar de bloquear la GPU.
+// Si la ventana cambia de tamaño, la secuencia PNG continúa con el nuevo tamaño;
+// el GIF no puede cambiar de tamaño, así que la grabación se detiene.
+class FrameRecorder
+{
+public:
+    enum class OutputFormat
+    {
+        PngSequence,
+        Gif
+    };
+
+    struct StartInfo
+    {
+        IRenderDevice* pDevice = nullptr;
+
+        Uint32         Width     = 0;
+        Uint32         Height    = 0;
+        TEXTURE_FORMAT Format    = TEX_FORMAT_UNKNOWN; // Formato del back buffer
+        OutputFormat   Output    = OutputFormat::PngSequence;
+        std::string    Directory = "Capture";
+
+        // Uso del swap chain: el back buffer debe poder copiarse (SWAP_CHAIN_USAGE_COPY_SOURCE)
+        SWAP_CHAIN_USAGE_FLAGS Usage = SWAP_CHAIN_USAGE_NONE;
+
+        Uint32 RingSize      = 4; // Texturas staging en vuelo
+        Uint32 NumWorkers    = 0; // 0: según hardware_concurrency
+        Uint32 Downscale     = 1; // Factor de reducción de la imagen codificada
+        Uint32 MaxQueuedJobs = 16;
+    };
+
+    FrameRecorder() = default;
+    ~FrameRecorder();
+
+    // clang-format off
+    FrameRecorder(const FrameRecorder&)            = delete;
+    FrameRecorder& operator=(const FrameRecorder&) = delete;
+    // clang-format on
+
+    bool Start(const StartInfo& Info);
+
+    // Espera a las copias pendientes y a que los hilos terminen de codificar
+    void Stop(IDeviceContext* pContext);
+
+    // Debe llamarse una vez por fotograma después de renderizar la escena.
+    // FrameTime es el tiempo transcurrido desde el fotograma anterior (se usa para el
+    // retardo del GIF y para las duraciones de frames.ffconcat).
+    void CaptureFrame(IDeviceContext* pContext, ITexture* pBackBuffer, double FrameTime);
+
+    bool IsRecording() const { return m_IsRecording; }
+
+    struct Statistics
+    {
+        Uint32 CapturedFrames = 0; // Copias enviadas a la GPU
+        Uint32 EncodedFrames  = 0; // Fotogramas ya escritos en disco
+        Uint32 DroppedFrames  = 0; // Descartados por falta de texturas o de hilos
+        Uint32 MergedFrames   = 0; // Fusionados con el anterior en el GIF (más de 50 FPS)
+        double CaptureTime    = 0; // Coste en CPU de CaptureFrame() en el último fotograma, en segundos
+        double AvgCaptureTime = 0; // Media móvil del coste de CaptureFrame()
+        double AvgGpuCopyTime = 0; // Media móvil de la duración en GPU de la copia del back buffer
+
+        bool GpuTimingAvailable = false; // El dispositivo admite consultas de duración
+    };
+    Statistics GetStatistics() const;
+
+private:
+    struct StagingSlot
+    {
+        RefCntAutoPtr<ITexture> pTexture;
+        Uint64                  FenceValue = 0;
+        double                  FrameTime  = 0;
+        bool                    InFlight   = false;
+    };
+
+    struct EncodeJob
+    {
+        Uint32             FrameIdx  = 0;
+        Uint32             GifDelay  = 0; // Centésimas de segundo
+        Uint32             SrcWidth  = 0; // Ancho del back buffer al capturar el fotograma
+        Uint32             OutWidth  = 0;
+        Uint32             OutHeight = 0;
+        std::vector<Uint8> Pixels; // Filas del back buffer tal cual (una de cada Downscale)
+    };
+
+    bool CreateStagingRing(Uint32 Width, Uint32 Height);
+
+    void ReadBackCompleted(IDeviceContext* pContext, bool Wait);
+    void ReadBackSlot(IDeviceContext* pContext, StagingSlot& Slot);
+    void WorkerThread();
+    void ConvertPixels(EncodeJob& Job) const;
+    void EncodePng(const EncodeJob& Job);
+    void EncodeGifFrame(const EncodeJob& Job);
+    void WriteGifHeader();
+    void WritePngDuration(Uint32 FrameIdx, double Duration);
+    void SubmitJob(EncodeJob&& Job);
+
+    StartInfo m_Info;
+    bool      m_IsRecording = false;
+    bool      m_IsBGRA      = false;
+    bool      m_FlipY       = false;
+    Uint32    m_OutWidth    = 0; // Tamaño de la imagen codificada (cambia si la ventana cambia de tamaño)
+    Uint32    m_OutHeight   = 0;
+
+    RefCntAutoPtr<IFence>    m_pFence;
+    Uint64                   m_NextFenceValue = 1;
+    std::vector<StagingSlot> m_Ring;
+    Uint32                   m_NextSlot     = 0; // Siguiente slot a escribir
+    Uint32                   m_OldestSlot   = 0; // Slot más antiguo en vuelo
+    Uint32                   m_NextFrameIdx = 0; // Índice del siguiente fotograma a codificar
+    // Tiempo de los fotogramas descartados, que se suma al siguiente que sí se guarda. Se lleva
+    // por separado según dónde se descartan: al capturar (anillo lleno) se suma a la siguiente
+    // copia enviada; al leer (cola llena, fallo al mapear) al siguiente fotograma leído, que
+    // puede ser una copia que ya estaba en vuelo
+    double                   m_CaptureDroppedTime  = 0;
+    double                   m_ReadBackDroppedTime = 0;
+    double                   m_LastFrameTime = 0; // Intervalo anterior al último fotograma, para estimar su duración al detener
+    double                   m_GifDelayCarry = 0; // Centésimas de segundo pendientes de asignar a un fotograma del GIF
+
+    // Último fotograma del GIF, a la espera del siguiente para conocer su retardo
+    EncodeJob m_HeldGifJob;
+    bool      m_HasHeldGifJob = false;
+
+    std::vector<std::thread> m_Workers;
+    std::deque<EncodeJob>    m_Jobs;
+    std::mutex               m_JobsMtx;
+    std::condition_variable  m_JobsCV;
+    bool                     m_StopWorkers = false;
+
+    std::ofstream m_PngTimingFile; // frames.ffconcat, solo se escribe desde el hilo de render
+
+    // Los fotogramas GIF se codifican en paralelo pero se escriben en orden
+    std::ofstream                        m_GifFile;
+    std::map<Uint32, std::vector<Uint8>> m_PendingGifFrames;
+    Uint32                               m_NextGifFrame = 0;
+    std::mutex                           m_GifMtx;
+
+    std::atomic<Uint32> m_CapturedFrames{0};
+    std::atomic<Uint32> m_EncodedFrames{0};
+    std::atomic<Uint32> m_DroppedFrames{0};
+    std::atomic<Uint32> m_MergedFrames{0};
+    double              m_CaptureTime    = 0;
+    double              m_AvgCaptureTime = 0;
+
+    // Mide en la GPU la copia del back buffer a la textura staging. El resultado llega
+    // con unos fotogramas de retraso, sin esperar a la GPU
+    std::unique_ptr<DurationQueryHelper> m_pCopyDurationQuery;
+    double                               m_AvgGpuCopyTime = 0;
+};
+
+} // namespace Diligent
@@ -0,0 +1,465 @@
+/*
+ *  Copyright 2019-2024 Diligent Graphics LLC
+ *  Copyright 2015-2019 Egor Yusov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  In no event and under no legal theory, whether in tort (including negligence),
+ *  contract, or otherwise, unless required by applicable law (such as deliberate
+ *  and grossly negligent acts) or agreed to in writing, shall any Contributor be
+ *  liable for any damages, including any direct, indirect, special, incidental,
+ *  or consequential damages of any character arising as a result of this License or
+ *  out of the use or inability to use the software (including but not limited to damages
+ *  for loss of goodwill, work stoppage, computer failure or malfunction, or any and
+ *  all other commercial damages or losses), even if such Contributor has been advised
+ *  of the possibility of such damages.
+ */
+
+#include "InstanceBVH.hpp"
+
+namespace Diligent
+{
+
+namespace
+{
+
+// Mitad del área de la superficie de la caja (la constante no afecta al SAH)
+inline float HalfArea(const float3& Min, const float3& Max)
+{
+    const float3 d = Max - Min;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+inline float Component(const float3& v, Uint32 Axis)
+{
+    return Axis == 0 ? v.x : (Axis == 1 ? v.y : v.z);
+}
+
+} // namespace
+
+void InstanceBVH::Clear()
+{
+    m_Nodes.clear();
+    m_Links.clear();
+    m_FreeNodes.clear();
+    m_PrimIndices.clear();
+    m_Centroids.clear();
+    m_Root     = InvalidNode;
+    m_NumPrims = 0;
+}
+
+Uint32 InstanceBVH::AllocateNode()
+{
+    Uint32 NodeIdx = 0;
+    if (!m_FreeNodes.empty())
+    {
+        NodeIdx = m_FreeNodes.back();
+        m_FreeNodes.pop_back();
+        m_Nodes[NodeIdx] = Node{};
+        m_Links[NodeIdx] = NodeLinks{};
+    }
+    else
+    {
+        NodeIdx = static_cast<Uint32>(m_Nodes.size());
+        m_Nodes.emplace_back();
+        m_Links.emplace_back();
+    }
+    return NodeIdx;
+}
+
+void InstanceBVH::FreeSubtree(Uint32 NodeIdx)
+{
+    const Node N = m_Nodes[NodeIdx];
+    if (N.IsLeaf())
+    {
+        m_NumPrims -= N.Right;
+    }
+    else
+    {
+        FreeSubtree(N.Left);
+        FreeSubtree(N.Right);
+    }
+    m_Links[NodeIdx] = NodeLinks{};
+    m_FreeNodes.push_back(NodeIdx);
+}
+
+Uint32 InstanceBVH::InsertGroup(const std::vector<AABB>& Bounds, Uint32 FirstPrim, Uint32 NumPrims)
+{
+    VERIFY_EXPR(NumPrims > 0 && size_t{FirstPrim} + NumPrims <= Bounds.size());
+
+    if (m_PrimIndices.size() < size_t{FirstPrim} + NumPrims)
+    {
+        m_PrimIndices.resize(size_t{FirstPrim} + NumPrims);
+        m_Centroids.resize(size_t{FirstPrim} + NumPrims);
+    }
+    for (Uint32 PrimIdx = FirstPrim; PrimIdx < FirstPrim + NumPrims; ++PrimIdx)
+    {
+        m_PrimIndices[PrimIdx] = PrimIdx;
+        m_Centroids[PrimIdx]   = (Bounds[PrimIdx].Min + Bounds[PrimIdx].Max) * 0.5f;
+    }
+
+    // El subárbol del grupo se construye con SAH igual que un BVH estático;
+    // su raíz no cambia mientras el grupo esté en el árbol y sirve de handle
+    const Uint32 GroupRoot = AllocateNode();
+    m_Nodes[GroupRoot].Left  = LeafFlag | FirstPrim;
+    m_Nodes[GroupRoot].Right = NumPrims;
+    UpdateNodeBounds(m_Nodes[GroupRoot], Bounds);
+    Subdivide(GroupRoot, 0, Bounds);
+
+    m_Links[GroupRoot].IsGroupRoot = true;
+    InsertIntoTree(GroupRoot);
+    m_NumPrims += NumPrims;
+
+    return GroupRoot;
+}
+
+void InstanceBVH::RemoveGroup(Uint32 Group)
+{
+    VERIFY(Group < m_Links.size() && m_Links[Group].IsGroupRoot, "Invalid BVH group");
+
+    RemoveFromTree(Group);
+    FreeSubtree(Group);
+}
+
+void InstanceBVH::UpdateNodeBounds(Node& N, const std::vector<AABB>& Bounds) const
+{
+    N.Min = float3{+FLT_MAX, +FLT_MAX, +FLT_MAX};
+    N.Max = float3{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (Uint32 i = 0; i < N.Right; ++i)
+    {
+        const AABB& Box = Bounds[m_PrimIndices[N.GetFirst() + i]];
+        N.Min           = std::min(N.Min, Box.Min);
+        N.Max           = std::max(N.Max, Box.Max);
+    }
+}
+
+void InstanceBVH::Subdivide(Uint32 NodeIdx, Uint32 Depth, const std::vector<AABB>& Bounds)
+{
+    const Uint32 First = m_Nodes[NodeIdx].GetFirst();
+    const Uint32 Count = m_Nodes[NodeIdx].Right;
+    if (Count <= MaxLeafSize || Depth >= MaxGroupDepth)
+        return;
+
+    float3 CentroidMin{+FLT_MAX, +FLT_MAX, +FLT_MAX};
+    float3 CentroidMax{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (Uint32 i = 0; i < Count; ++i)
+    {
+        const float3& c = m_Centroids[m_PrimIndices[First + i]];
+        CentroidMin     = std::min(CentroidMin, c);
+        CentroidMax     = std::max(CentroidMax, c);
+    }
+
+    // SAH por intervalos: se reparten los centroides en NumBins intervalos por eje
+    // y se evalúan los NumBins - 1 planos de corte entre ellos
+    float  BestCost  = FLT_MAX;
+    Uint32 BestAxis  = 0;
+    Uint32 BestSplit = 0;
+    for (Uint32 Axis = 0; Axis < 3; ++Axis)
+    {
+        const float AxisMin = Component(CentroidMin, Axis);
+        const float Extent  = Component(CentroidMax, Axis) - AxisMin;
+        if (Extent <= 0)
+            continue;
+
+        struct Bin
+        {
+            float3 Min{+FLT_MAX, +FLT_MAX, +FLT_MAX};
+            float3 Max{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+            Uint32 Count = 0;
+        };
+        Bin Bins[NumBins];
+
+        const float Scale = static_cast<float>(NumBins) / Extent;
+        for (Uint32 i = 0; i < Count; ++i)
+        {
+            const Uint32 PrimIdx = m_PrimIndices[First + i];
+            const Uint32 BinIdx  = std::min(NumBins - 1, static_cast<Uint32>((Component(m_Centroids[PrimIdx], Axis) - AxisMin) * Scale));
+            Bins[BinIdx].Min     = std::min(Bins[BinIdx].Min, Bounds[PrimIdx].Min);
+            Bins[BinIdx].Max     = std::max(Bins[BinIdx].Max, Bounds[PrimIdx].Max);
+            ++Bins[BinIdx].Count;
+        }
+
+        // Barrido de izquierda a derecha y de derecha a izquierda
+        float  LeftArea[NumBins - 1];
+        Uint32 LeftCount[NumBins - 1];
+        float3 Min{+FLT_MAX, +FLT_MAX, +FLT_MAX};
+        float3 Max{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        Uint32 Sum = 0;
+        for (Uint32 i = 0; i < NumBins - 1; ++i)
+        {
+            Sum += Bins[i].Count;
+            Min          = std::min(Min, Bins[i].Min);
+            Max          = std::max(Max, Bins[i].Max);
+            LeftCount[i] = Sum;
+            LeftArea[i]  = Sum > 0 ? HalfArea(Min, Max) : 0;
+        }
+
+        Min = float3{+FLT_MAX, +FLT_MAX, +FLT_MAX};
+        Max = float3{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        Sum = 0;
+        for (Uint32 i = NumBins - 1; i > 0; --i)
+        {
+            Sum += Bins[i].Count;
+            Min = std::min(Min, Bins[i].Min);
+            Max = std::max(Max, Bins[i].Max);
+            if (Sum == 0 || LeftCount[i - 1] == 0)
+                continue;
+
+            const float Cost = LeftArea[i - 1] * static_cast<float>(LeftCount[i - 1]) + HalfArea(Min, Max) * static_cast<float>(Sum);
+            if (Cost < BestCost)
+            {
+                BestCost  = Cost;
+                BestAxis  = Axis;
+                BestSplit = i;
+            }
+        }
+    }
+
+    // Si ningún corte mejora el coste de dejar el nodo como hoja, no se divide
+    const float LeafCost = HalfArea(m_Nodes[NodeIdx].Min, m_Nodes[NodeIdx].Max) * static_cast<float>(Count);
+    if (BestCost >= LeafCost)
+        return;
+
+    const float AxisMin = Component(CentroidMin, BestAxis);
+    const float Scale   = static_cast<float>(NumBins) / (Component(CentroidMax, BestAxis) - AxisMin);
+    auto* const pMiddle = std::partition(m_PrimIndices.data() + First, m_PrimIndices.data() + First + Count,
+                                         [&](Uint32 PrimIdx) {
+                                             const Uint32 BinIdx = std::min(NumBins - 1, static_cast<Uint32>((Component(m_Centroids[PrimIdx], BestAxis) - AxisMin) * Scale));
+                                             return BinIdx < BestSplit;
+                                         });
+    const Uint32 LeftCount = static_cast<Uint32>(pMiddle - (m_PrimIndices.data() + First));
+    if (LeftCount == 0 || LeftCount == Count)
+        return;
+
+    // AllocateNode() puede mover m_Nodes, así que no se guardan referencias a nodos
+    const Uint32 LeftIdx  = AllocateNode();
+    const Uint32 RightIdx = AllocateNode();
+    m_Nodes[LeftIdx].Left   = LeafFlag | First;
+    m_Nodes[LeftIdx].Right  = LeftCount;
+    m_Nodes[RightIdx].Left  = LeafFlag | (First + LeftCount);
+    m_Nodes[RightIdx].Right = Count - LeftCount;
+    UpdateNodeBounds(m_Nodes[LeftIdx], Bounds);
+    UpdateNodeBounds(m_Nodes[RightIdx], Bounds);
+    m_Links[LeftIdx].Parent  = NodeIdx;
+    m_Links[RightIdx].Parent = NodeIdx;
+
+    m_Nodes[NodeIdx].Left  = LeftIdx;
+    m_Nodes[NodeIdx].Right = RightIdx;
+
+    Subdivide(LeftIdx, Depth + 1, Bounds);
+    Subdivide(RightIdx, Depth + 1, Bounds);
+}
+
+void InstanceBVH::ReplaceChild(Uint32 Parent, Uint32 OldChild, Uint32 NewChild)
+{
+    if (Parent == InvalidNode)
+    {
+        m_Root = NewChild;
+    }
+    else if (m_Nodes[Parent].Left == OldChild)
+    {
+        m_Nodes[Parent].Left = NewChild;
+    }
+    else
+    {
+        VERIFY_EXPR(m_Nodes[Parent].Right == OldChild);
+        m_Nodes[Parent].Right = NewChild;
+    }
+    m_Links[NewChild].Parent = Parent;
+}
+
+void InstanceBVH::InsertIntoTree(Uint32 GroupRoot)
+{
+    if (m_Root == InvalidNode)
+    {
+        m_Root                    = GroupRoot;
+        m_Links[GroupRoot].Parent = InvalidNode;
+        return;
+    }
+
+    // Se baja por el árbol superior buscando el hermano que menos aumenta el área total
+    // (coste SAH de la inserción). Las raíces de grupo no se atraviesan.
+    const float3 GroupMin = m_Nodes[GroupRoot].Min;
+    const float3 GroupMax = m_Nodes[GroupRoot].Max;
+
+    Uint32 Sibling = m_Root;
+    while (!m_Links[Sibling].IsGroupRoot)
+    {
+        const Node& N            = m_Nodes[Sibling];
+        const float Area         = HalfArea(N.Min, N.Max);
+        const float CombinedArea = HalfArea(std::min(N.Min, GroupMin), std::max(N.Max, GroupMax));
+
+        // Coste de crear aquí un nuevo padre para el nodo y el grupo, y coste mínimo
+        // que heredan los descendientes al agrandarse este nodo
+        const float Cost        = 2 * CombinedArea;
+        const float Inheritance = 2 * (CombinedArea - Area);
+
+        auto GetChildCost = [&](Uint32 Child) {
+            const Node& C         = m_Nodes[Child];
+            const float ChildArea = HalfArea(std::min(C.Min, GroupMin), std::max(C.Max, GroupMax));
+            return m_Links[Child].IsGroupRoot ?
+                ChildArea + Inheritance :
+                ChildArea - HalfArea(C.Min, C.Max) + Inheritance;
+        };
+        const float LeftCost  = GetChildCost(N.Left);
+        const float RightCost = GetChildCost(N.Right);
+        if (Cost < LeftCost && Cost < RightCost)
+            break;
+
+        Sibling = LeftCost < RightCost ? N.Left : N.Right;
+    }
+
+    const Uint32 OldParent = m_Links[Sibling].Parent;
+    const Uint32 NewParent = AllocateNode();
+    ReplaceChild(OldParent, Sibling, NewParent);
+    m_Nodes[NewParent].Left   = Sibling;
+    m_Nodes[NewParent].Right  = GroupRoot;
+    m_Links[Sibling].Parent   = NewParent;
+    m_Links[GroupRoot].Parent = NewParent;
+
+    UpdateAncestors(NewParent);
+}
+
+void InstanceBVH::RemoveFromTree(Uint32 GroupRoot)
+{
+    if (GroupRoot == m_Root)
+    {
+        m_Root = InvalidNode;
+        return;
+    }
+
+    // El hermano ocupa el lugar del padre, que deja de ser necesario
+    const Uint32 Parent  = m_Links[GroupRoot].Parent;
+    const Uint32 Sibling = m_Nodes[Parent].Left == GroupRoot ? m_Nodes[Parent].Right : m_Nodes[Parent].Left;
+    const Uint32 Grand   = m_Links[Parent].Parent;
+    ReplaceChild(Grand, Parent, Sibling);
+
+    m_Links[Parent] = NodeLinks{};
+    m_FreeNodes.push_back(Parent);
+    m_Links[GroupRoot].Parent = InvalidNode;
+
+    if (Grand != InvalidNode)
+        UpdateAncestors(Grand);
+}
+
+void InstanceBVH::UpdateAncestors(Uint32 NodeIdx)
+{
+    // Se reequilibra y se recalculan caja y altura desde el nodo hasta la raíz
+    while (NodeIdx != InvalidNode)
+    {
+        NodeIdx = Balance(NodeIdx);
+
+        Node&       N     = m_Nodes[NodeIdx];
+        const Node& Left  = m_Nodes[N.Left];
+        const Node& Right = m_Nodes[N.Right];
+        N.Min             = std::min(Left.Min, Right.Min);
+        N.Max             = std::max(Left.Max, Right.Max);
+
+        m_Links[NodeIdx].Height = 1 + std::max(m_Links[N.Left].Height, m_Links[N.Right].Height);
+
+        NodeIdx = m_Links[NodeIdx].Parent;
+    }
+}
+
+Uint32 InstanceBVH::Balance(Uint32 A)
+{
+    // Rotación como en un árbol AVL: si un hijo es más de un nivel más alto que el otro,
+    // sube a ocupar el lugar de A y A se queda con el nieto más bajo
+    if (m_Links[A].IsGroupRoot || m_Links[A].Height < 2)
+        return A;
+
+    const Uint32 B          = m_Nodes[A].Left;
+    const Uint32 C          = m_Nodes[A].Right;
+    const int    HeightDiff = static_cast<int>(m_Links[C].Height) - static_cast<int>(m_Links[B].Height);
+    if (HeightDiff >= -1 && HeightDiff <= 1)
+        return A;
+
+    // Up es el hijo que sube y Low el que se queda bajo A
+    const bool   RotateRight = HeightDiff < -1;
+    const Uint32 Up          = RotateRight ? B : C;
+    const Uint32 Low         = RotateRight ? C : B;
+    const Uint32 F           = m_Nodes[Up].Left;
+    const Uint32 G           = m_Nodes[Up].Right;
+
+    ReplaceChild(m_Links[A].Parent, A, Up);
+    m_Links[A].Parent = Up;
+
+    // El nieto más alto se queda en Up; el más bajo pasa a A en el lugar de Up
+    const bool   KeepF = m_Links[F].Height > m_Links[G].Height;
+    const Uint32 Kept  = KeepF ? F : G;
+    const Uint32 Moved = KeepF ? G : F;
+
+    m_Nodes[Up].Left  = A;
+    m_Nodes[Up].Right = Kept;
+    if (RotateRight)
+        m_Nodes[A].Left = Moved;
+    else
+        m_Nodes[A].Right = Moved;
+    m_Links[Moved].Parent = A;
+
+    Node& NA = m_Nodes[A];
+    NA.Min   = std::min(m_Nodes[Low].Min, m_Nodes[Moved].Min);
+    NA.Max   = std::max(m_Nodes[Low].Max, m_Nodes[Moved].Max);
+    m_Links[A].Height = 1 + std::max(m_Links[Low].Height, m_Links[Moved].Height);
+
+    Node& NUp = m_Nodes[Up];
+    NUp.Min   = std::min(NA.Min, m_Nodes[Kept].Min);
+    NUp.Max   = std::max(NA.Max, m_Nodes[Kept].Max);
+    m_Links[Up].Height = 1 + std::max(m_Links[A].Height, m_Links[Kept].Height);
+
+    return Up;
+}
+
+void InstanceBVH::RefitNode(Uint32 NodeIdx, const std::vector<AABB>& Bounds)
+{
+    Node& N = m_Nodes[NodeIdx];
+    if (N.IsLeaf())
+    {
+        UpdateNodeBounds(N, Bounds);
+        return;
+    }
+
+    RefitNode(N.Left, Bounds);
+    RefitNode(N.Right, Bounds);
+
+    const Node& Left  = m_Nodes[N.Left];
+    const Node& Right = m_Nodes[N.Right];
+    N.Min             = std::min(Left.Min, Right.Min);
+    N.Max             = std::max(Left.Max, Right.Max);
+}
+
+void InstanceBVH::Refit(const std::vector<AABB>& Bounds)
+{
+    VERIFY(Bounds.size() >= m_PrimIndices.size(), "Bounds must cover every primitive in the BVH");
+
+    // La profundidad está acotada por MaxGroupDepth más la altura del árbol superior
+    if (m_Root != InvalidNode)
+        RefitNode(m_Root, Bounds);
+}
+
+bool InstanceBVH::IntersectRayAABB(const float3& Origin, const float3& InvDir, const float3& Min, const float3& Max, float MaxDist, float& EnterDist)
+{
+    // Prueba de las tres franjas (slabs)
+    const float3 t0 = (Min - Origin) * InvDir;
+    const float3 t1 = (Max - Origin) * InvDir;
+    const float3 tMin = std::min(t0, t1);
+    const float3 tMax = std::max(t0, t1);
+
+    const float Enter = std::max(std::max(tMin.x, tMin.y), tMin.z);
+    const float Exit  = std::min(std::min(tMax.x, tMax.y), tMax.z);
+
+    EnterDist = std::max(Enter, 0.f);
+    return Exit >= EnterDist && EnterDist < MaxDist;
+}
+
+} // namespace Diligent
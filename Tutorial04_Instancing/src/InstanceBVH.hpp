@@ -0,0 +1,235 @@
+/*
+ *  Copyright 2019-2024 Diligent Graphics LLC
+ *  Copyright 2015-2019 Egor Yusov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  In no event and under no legal theory, whether in tort (including negligence),
+ *  contract, or otherwise, unless required by applicable law (such as deliberate
+ *  and grossly negligent acts) or agreed to in writing, shall any Contributor be
+ *  liable for any damages, including any direct, indirect, special, incidental,
+ *  or consequential damages of any character arising as a result of this License or
+ *  out of the use or inability to use the software (including but not limited to damages
+ *  for loss of goodwill, work stoppage, computer failure or malfunction, or any and
+ *  all other commercial damages or losses), even if such Contributor has been advised
+ *  of the possibility of such damages.
+ */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+
+#include "BasicMath.hpp"
+#include "DebugUtilities.hpp"
+
+namespace Diligent
+{
+
+// BVH sobre las cajas envolventes (en espacio de mundo) de las instancias.
+// Las primitivas se insertan y se quitan por grupos (un móvil entero): cada grupo se
+// construye como un subárbol con SAH por intervalos y se cuelga de un árbol superior
+// dinámico, que se mantiene equilibrado con rotaciones. Añadir o quitar un grupo solo
+// toca el camino hasta la raíz, sin reconstruir el resto del árbol.
+// Refit() conserva la topología y solo recalcula las cajas de abajo arriba, lo que basta
+// cuando las instancias se mueven de forma coherente (como los niveles del móvil al girar).
+class InstanceBVH
+{
+public:
+    struct AABB
+    {
+        float3 Min;
+        float3 Max;
+    };
+
+    static constexpr Uint32 InvalidGroup = ~0u;
+
+    // Inserta las primitivas [FirstPrim, FirstPrim + NumPrims) como un grupo y devuelve su
+    // handle. Los índices de primitiva son los de Bounds y no pueden pertenecer a otro grupo.
+    Uint32 InsertGroup(const std::vector<AABB>& Bounds, Uint32 FirstPrim, Uint32 NumPrims);
+    void   RemoveGroup(Uint32 Group);
+
+    void Refit(const std::vector<AABB>& Bounds);
+    void Clear();
+
+    Uint32 GetNumPrimitives() const { return m_NumPrims; }
+    Uint32 GetNumNodes() const { return static_cast<Uint32>(m_Nodes.size() - m_FreeNodes.size()); }
+
+    // Devuelve la primitiva más cercana a lo largo del rayo.
+    // PrimTest(PrimIdx, Distance) hace la prueba exacta contra la primitiva y solo se
+    // llama para las primitivas cuya caja corta el rayo antes del mejor resultado actual.
+    template <typename PrimTestType>
+    bool RayCast(const float3& Origin, const float3& Dir, PrimTestType&& PrimTest, Uint32& HitPrim, float& HitDist) const;
+
+    static bool IntersectRayAABB(const float3& Origin, const float3& InvDir, const float3& Min, const float3& Max, float MaxDist, float& EnterDist);
+
+private:
+    // Nodo de 32 bytes. En una hoja Left = LeafFlag | First y Right = Count, con las
+    // primitivas m_PrimIndices[First, First + Count); si no, Left y Right son los hijos.
+    struct Node
+    {
+        float3 Min;
+        Uint32 Left = 0;
+        float3 Max;
+        Uint32 Right = 0;
+
+        bool   IsLeaf() const { return (Left & LeafFlag) != 0; }
+        Uint32 GetFirst() const { return Left & ~LeafFlag; }
+    };
+
+    // Datos que solo hacen falta al insertar o quitar grupos, fuera del nodo
+    // para no agrandarlo
+    struct NodeLinks
+    {
+        Uint32 Parent      = InvalidNode;
+        Uint32 Height      = 0;     // Altura en el árbol superior (las raíces de grupo tienen 0)
+        bool   IsGroupRoot = false; // Las raíces de grupo son las hojas del árbol superior
+    };
+
+    Uint32 AllocateNode();
+    void   FreeSubtree(Uint32 NodeIdx);
+    void   Subdivide(Uint32 NodeIdx, Uint32 Depth, const std::vector<AABB>& Bounds);
+    void   UpdateNodeBounds(Node& N, const std::vector<AABB>& Bounds) const;
+    void   RefitNode(Uint32 NodeIdx, const std::vector<AABB>& Bounds);
+
+    void   InsertIntoTree(Uint32 GroupRoot);
+    void   RemoveFromTree(Uint32 GroupRoot);
+    void   ReplaceChild(Uint32 Parent, Uint32 OldChild, Uint32 NewChild);
+    void   UpdateAncestors(Uint32 NodeIdx);
+    Uint32 Balance(Uint32 NodeIdx);
+
+    static constexpr Uint32 InvalidNode = ~0u;
+    static constexpr Uint32 LeafFlag    = 0x80000000u;
+    static constexpr Uint32 MaxLeafSize = 4;
+    static constexpr Uint32 NumBins     = 12;
+    // A partir de esta profundidad (dentro de un grupo) los nodos se dejan como hojas
+    // aunque tengan más primitivas
+    static constexpr Uint32 MaxGroupDepth = 32;
+    // Basta para MaxGroupDepth más la altura del árbol superior equilibrado; si aun así
+    // se llena, RayCast() pasa a una pila en el heap en lugar de escribir fuera del array
+    static constexpr Uint32 LocalStackSize = 64;
+
+    std::vector<Node>      m_Nodes;
+    std::vector<NodeLinks> m_Links;
+    std::vector<Uint32>    m_FreeNodes;
+    Uint32                 m_Root     = InvalidNode;
+    Uint32                 m_NumPrims = 0;
+
+    // Indexados por primitiva: cada grupo guarda en [FirstPrim, FirstPrim + NumPrims)
+    // su propia permutación de índices, así que no hace falta repartir memoria entre grupos
+    std::vector<Uint32> m_PrimIndices;
+    std::vector<float3> m_Centroids; // Solo se usan al construir el subárbol de un grupo
+};
+
+template <typename PrimTestType>
+bool InstanceBVH::RayCast(const float3& Origin, const float3& Dir, PrimTestType&& PrimTest, Uint32& HitPrim, float& HitDist) const
+{
+    HitPrim = ~0u;
+    HitDist = FLT_MAX;
+    if (m_Root == InvalidNode)
+        return false;
+
+    const float3 InvDir{
+        Dir.x != 0 ? 1.f / Dir.x : FLT_MAX,
+        Dir.y != 0 ? 1.f / Dir.y : FLT_MAX,
+        Dir.z != 0 ? 1.f / Dir.z : FLT_MAX,
+    };
+
+    float EnterDist = 0;
+    if (!IntersectRayAABB(Origin, InvDir, m_Nodes[m_Root].Min, m_Nodes[m_Root].Max, HitDist, EnterDist))
+        return false;
+
+    // Cada entrada guarda también la distancia de entrada en la caja del nodo,
+    // para descartarlo si mientras tanto se ha encontrado algo más cercano
+    struct StackEntry
+    {
+        Uint32 NodeIdx;
+        float  EnterDist;
+    };
+    StackEntry              LocalStack[LocalStackSize];
+    std::vector<StackEntry> HeapStack;
+    StackEntry*             Stack         = LocalStack;
+    Uint32                  StackCapacity = LocalStackSize;
+    Uint32                  StackSize     = 0;
+
+    auto Push = [&](Uint32 NodeIdx, float Dist) {
+        if (StackSize == StackCapacity)
+        {
+            if (HeapStack.empty())
+                HeapStack.assign(LocalStack, LocalStack + StackSize);
+            HeapStack.resize(size_t{StackCapacity} * 2);
+            Stack = HeapStack.data();
+            StackCapacity *= 2;
+        }
+        Stack[StackSize++] = {NodeIdx, Dist};
+    };
+
+    Push(m_Root, EnterDist);
+    while (StackSize > 0)
+    {
+        const StackEntry Entry = Stack[--StackSize];
+        if (Entry.EnterDist >= HitDist)
+            continue;
+
+        const Node& N = m_Nodes[Entry.NodeIdx];
+        if (N.IsLeaf())
+        {
+            for (Uint32 i = 0; i < N.Right; ++i)
+            {
+                const Uint32 PrimIdx = m_PrimIndices[N.GetFirst() + i];
+                float        Dist    = FLT_MAX;
+                if (PrimTest(PrimIdx, Dist) && Dist < HitDist)
+                {
+                    HitDist = Dist;
+                    HitPrim = PrimIdx;
+                }
+            }
+            continue;
+        }
+
+        // Se visita primero el hijo más cercano; los que quedan detrás del
+        // mejor resultado actual se descartan
+        const Uint32 Child0 = N.Left;
+        const Uint32 Child1 = N.Right;
+        float        Dist0 = 0, Dist1 = 0;
+        const bool   Hit0 = IntersectRayAABB(Origin, InvDir, m_Nodes[Child0].Min, m_Nodes[Child0].Max, HitDist, Dist0);
+        const bool   Hit1 = IntersectRayAABB(Origin, InvDir, m_Nodes[Child1].Min, m_Nodes[Child1].Max, HitDist, Dist1);
+        if (Hit0 && Hit1)
+        {
+            // El último en apilarse es el primero en visitarse
+            if (Dist0 < Dist1)
+            {
+                Push(Child1, Dist1);
+                Push(Child0, Dist0);
+            }
+            else
+            {
+                Push(Child0, Dist0);
+                Push(Child1, Dist1);
+            }
+        }
+        else if (Hit0)
+        {
+            Push(Child0, Dist0);
+        }
+        else if (Hit1)
+        {
+            Push(Child1, Dist1);
+        }
+    }
+
+    return HitPrim != ~0u;
+}
+
+} // namespace Diligent
@@ -0,0 +1,283 @@
+/*
+ *  Copyright 2019-2024 Diligent Graphics LLC
+ *  Copyright 2015-2019 Egor Yusov
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  In no event and under no legal theory, whether in tort (including negligence),
+ *  contract, or otherwise, unless required by applicable law (such as deliberate
+ *  and grossly negligent acts) or agreed to in writing, shall any Contributor be
+ *  liable for any damages, including any direct, indirect, special, incidental,
+ *  or consequential damages of any character arising as a result of this License or
+ *  out of the use or inability to use the software (including but not limited to damages
+ *  for loss of goodwill, work stoppage, computer failure or malfunction, or any and
+ *  all other commercial damages or losses), even if such Contributor has been advised
+ *  of the possibility of such damages.
+ */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "RenderDevice.h"
+#include "DeviceContext.h"
+#include "Buffer.h"
+#include "RefCntAutoPtr.hpp"
+#include "DebugUtilities.hpp"
+
+namespace Diligent
+{
+
+// Pool de instancias con handles estables.
+// Los datos se guardan de forma contigua (en CPU y en el buffer de GPU), por lo que
+// el número de instancias a dibujar es siempre GetCount(). Al eliminar una instancia
+// el último elemento ocupa su lugar (swap-remove), y una tabla de slots con lista libre
+// mantiene los handles válidos aunque los datos se muevan.
+// Cada elemento modificado desde el último Flush() se marca como sucio, y Flush() solo
+// sube los tramos de elementos sucios. Los huecos limpios cortos se suben junto con los
+// tramos que los rodean: cada UpdateBuffer es un comando de copia aparte, mucho más caro
+// que unos bytes de más. El buffer crece de forma geométrica cuando se queda sin capacidad.
+template <typename InstanceType>
+class InstancePool
+{
+public:
+    static constexpr Uint32 InvalidIndex = ~0u;
+
+    // La generación permite detectar handles que apuntan a una instancia ya eliminada
+    struct Handle
+    {
+        Uint32 Slot       = InvalidIndex;
+        Uint32 Generation = 0;
+
+        bool IsValid() const { return Slot != InvalidIndex; }
+    };
+
+    // El Size de BuffDesc se ignora: lo determina la capacidad del pool
+    void Initialize(const BufferDesc& BuffDesc, Uint32 InitialCapacity)
+    {
+        m_BuffDesc        = BuffDesc;
+        m_InitialCapacity = std::max(InitialCapacity, 1u);
+    }
+
+    Handle Add(const InstanceType& Data)
+    {
+        Uint32 Slot = InvalidIndex;
+        if (!m_FreeSlots.empty())
+        {
+            Slot = m_FreeSlots.back();
+            m_FreeSlots.pop_back();
+        }
+        else
+        {
+            Slot = static_cast<Uint32>(m_SlotToDense.size());
+            m_SlotToDense.push_back(InvalidIndex);
+            m_Generations.push_back(0);
+        }
+
+        const Uint32 DenseIdx = GetCount();
+        m_Data.push_back(Data);
+        m_DenseToSlot.push_back(Slot);
+        m_DirtyFlags.push_back(0);
+        m_SlotToDense[Slot] = DenseIdx;
+        MarkDirty(DenseIdx);
+
+        return Handle{Slot, m_Generations[Slot]};
+    }
+
+    void Remove(const Handle& h)
+    {
+        if (!IsAlive(h))
+        {
+            UNEXPECTED("Intentando eliminar una instancia que no existe");
+            return;
+        }
+
+        const Uint32 DenseIdx = m_SlotToDense[h.Slot];
+        const Uint32 LastIdx  = GetCount() - 1;
+        if (DenseIdx != LastIdx)
+        {
+            // Movemos el último elemento al hueco para mantener los datos compactos
+            const Uint32 MovedSlot  = m_DenseToSlot[LastIdx];
+            m_Data[DenseIdx]        = m_Data[LastIdx];
+            m_DenseToSlot[DenseIdx] = MovedSlot;
+            m_SlotToDense[MovedSlot] = DenseIdx;
+            MarkDirty(DenseIdx);
+        }
+        m_Data.pop_back();
+        m_DenseToSlot.pop_back();
+        m_DirtyFlags.pop_back();
+
+        m_SlotToDense[h.Slot] = InvalidIndex;
+        ++m_Generations[h.Slot];
+        m_FreeSlots.push_back(h.Slot);
+    }
+
+    bool IsAlive(const Handle& h) const
+    {
+        return h.Slot < m_SlotToDense.size() &&
+            m_SlotToDense[h.Slot] != InvalidIndex &&
+            m_Generations[h.Slot] == h.Generation;
+    }
+
+    void Update(const Handle& h, const InstanceType& Data)
+    {
+        VERIFY(IsAlive(h), "Handle de instancia no válido");
+        const Uint32 DenseIdx = m_SlotToDense[h.Slot];
+        m_Data[DenseIdx]      = Data;
+        MarkDirty(DenseIdx);
+    }
+
+    const InstanceType& Get(const Handle& h) const
+    {
+        VERIFY(IsAlive(h), "Handle de instancia no válido");
+        return m_Data[m_SlotToDense[h.Slot]];
+    }
+
+    // Posición actual de la instancia en el buffer (cambia con los swap-remove)
+    Uint32 GetDenseIndex(const Handle& h) const
+    {
+        VERIFY(IsAlive(h), "Handle de instancia no válido");
+        return m_SlotToDense[h.Slot];
+    }
+
+    // Sube a la GPU los tramos modificados. Si el buffer no tiene capacidad suficiente
+    // se vuelve a crear con el doble de tamaño y se sube todo su contenido.
+    // Devuelve true si el buffer se ha recreado (hay que volver a enlazarlo).
+    bool Flush(IRenderDevice* pDevice, IDeviceContext* pContext)
+    {
+        const Uint32 Count     = GetCount();
+        bool         Recreated = false;
+        // Los elementos eliminados al final del rango ya no hace falta subirlos
+        const Uint32 DirtyEnd = std::min(m_DirtyEnd, Count);
+
+        m_LastUploadBytes  = 0;
+        m_LastUploadRanges = 0;
+        if (!m_pBuffer || Count > m_Capacity)
+        {
+            Uint32 NewCapacity = std::max(m_Capacity, m_InitialCapacity);
+            while (NewCapacity < Count)
+                NewCapacity *= 2;
+
+            BufferDesc Desc = m_BuffDesc;
+            Desc.Size       = Uint64{sizeof(InstanceType)} * NewCapacity;
+            m_pBuffer.Release();
+            pDevice->CreateBuffer(Desc, nullptr, &m_pBuffer);
+            VERIFY_EXPR(m_pBuffer);
+
+            m_Capacity = NewCapacity;
+            Recreated  = true;
+            if (Count > 0)
+                UploadRange(pContext, 0, Count);
+        }
+        else
+        {
+            // Solo se recorren los indicadores dentro de la envolvente de los elementos sucios
+            Uint32 i = m_DirtyBegin;
+            while (i < DirtyEnd)
+            {
+                if (!m_DirtyFlags[i])
+                {
+                    ++i;
+                    continue;
+                }
+
+                // El tramo continúa mientras los huecos limpios no superen MaxCleanGap elementos
+                const Uint32 RangeBegin = i;
+                Uint32       RangeEnd   = i;
+                while (i < DirtyEnd)
+                {
+                    if (m_DirtyFlags[i])
+                        RangeEnd = ++i;
+                    else if (i - RangeEnd < MaxCleanGap)
+                        ++i;
+                    else
+                        break;
+                }
+                UploadRange(pContext, RangeBegin, RangeEnd);
+            }
+        }
+
+        if (m_DirtyBegin < DirtyEnd)
+            std::fill(m_DirtyFlags.begin() + m_DirtyBegin, m_DirtyFlags.begin() + DirtyEnd, Uint8{0});
+        m_DirtyBegin = InvalidIndex;
+        m_DirtyEnd   = 0;
+        return Recreated;
+    }
+
+    void Clear()
+    {
+        m_Data.clear();
+        m_DenseToSlot.clear();
+        m_FreeSlots.clear();
+        for (Uint32 Slot = 0; Slot < m_SlotToDense.size(); ++Slot)
+        {
+            if (m_SlotToDense[Slot] != InvalidIndex)
+                ++m_Generations[Slot];
+            m_SlotToDense[Slot] = InvalidIndex;
+            m_FreeSlots.push_back(Slot);
+        }
+        m_DirtyFlags.clear();
+        m_DirtyBegin = InvalidIndex;
+        m_DirtyEnd   = 0;
+    }
+
+    Uint32              GetCount() const { return static_cast<Uint32>(m_Data.size()); }
+    Uint32              GetCapacity() const { return m_Capacity; }
+    Uint64              GetLastUploadBytes() const { return m_LastUploadBytes; }
+    Uint32              GetLastUploadRanges() const { return m_LastUploadRanges; }
+    IBuffer*            GetBuffer() const { return m_pBuffer; }
+    const InstanceType* GetData() const { return m_Data.data(); }
+
+private:
+    // Hueco limpio más largo (unos 4 KB) que se sube con los tramos sucios que lo rodean
+    static constexpr Uint32 MaxCleanGap = std::max<Uint32>(4096 / sizeof(InstanceType), 1);
+
+    void MarkDirty(Uint32 DenseIdx)
+    {
+        m_DirtyFlags[DenseIdx] = 1;
+        m_DirtyBegin           = std::min(m_DirtyBegin, DenseIdx);
+        m_DirtyEnd             = std::max(m_DirtyEnd, DenseIdx + 1);
+    }
+
+    void UploadRange(IDeviceContext* pContext, Uint32 Begin, Uint32 End)
+    {
+        const Uint64 Offset = Uint64{sizeof(InstanceType)} * Begin;
+        const Uint64 Size   = Uint64{sizeof(InstanceType)} * (End - Begin);
+        pContext->UpdateBuffer(m_pBuffer, Offset, Size, &m_Data[Begin], RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+        m_LastUploadBytes += Size;
+        ++m_LastUploadRanges;
+    }
+
+    BufferDesc m_BuffDesc;
+    Uint32     m_InitialCapacity = 64;
+    Uint32     m_Capacity        = 0;
+
+    RefCntAutoPtr<IBuffer> m_pBuffer;
+
+    std::vector<InstanceType> m_Data;        // Datos compactos, en el mismo orden que en la GPU
+    std::vector<Uint32>       m_DenseToSlot; // Índice compacto -> slot del handle
+    std::vector<Uint32>       m_SlotToDense; // Slot del handle -> índice compacto
+    std::vector<Uint32>       m_Generations; // Generación actual de cada slot
+    std::vector<Uint32>       m_FreeSlots;   // Lista libre de slots reutilizables
+    std::vector<Uint8>        m_DirtyFlags;  // Elementos modificados desde el último Flush()
+
+    // Envolvente [m_DirtyBegin, m_DirtyEnd) de los elementos sucios: limita el recorrido
+    // de m_DirtyFlags en Flush() cuando solo cambian unos pocos elementos
+    Uint32 m_DirtyBegin       = InvalidIndex;
+    Uint32 m_DirtyEnd         = 0;
+    Uint64 m_LastUploadBytes  = 0;
+    Uint32 m_LastUploadRanges = 0;
+};
+
+} // namespace Diligent
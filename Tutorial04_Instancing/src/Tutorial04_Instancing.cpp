@@ -26,6 +26,9 @@
  */
 
 #include <random>
+#include <chrono>
+#include <cfloat>
+#include <algorithm>
 
 #include "Tutorial04_Instancing.hpp"
 #include "MapHelper.hpp"
@@ -42,11 +45,50 @@
 namespace Diligent
 {
 
+namespace
+{
+
+// Caja envolvente en espacio de mundo del cubo [-1, 1]^3 transformado por World
+InstanceBVH::AABB ComputePieceBounds(const float4x4& World)
+{
+    const float3 Center{World.m30, World.m31, World.m32};
+    const float3 Extent{
+        std::abs(World.m00) + std::abs(World.m10) + std::abs(World.m20),
+        std::abs(World.m01) + std::abs(World.m11) + std::abs(World.m21),
+        std::abs(World.m02) + std::abs(World.m12) + std::abs(World.m22),
+    };
+    return {Center - Extent, Center + Extent};
+}
+
+// Prueba exacta del rayo contra la pieza: el rayo se lleva al espacio local del cubo.
+// Dist se mide en unidades del parámetro del rayo, igual para todas las piezas.
+bool IntersectRayPiece(const float4x4& World, const float3& Origin, const float3& Dir, float& Dist)
+{
+    const float4x4 InvWorld    = World.Inverse();
+    const float4   LocalOrigin = float4{Origin, 1.0f} * InvWorld;
+    const float4   LocalDir    = float4{Dir, 0.0f} * InvWorld;
+    const float3   InvDir{
+        LocalDir.x != 0 ? 1.f / LocalDir.x : FLT_MAX,
+        LocalDir.y != 0 ? 1.f / LocalDir.y : FLT_MAX,
+        LocalDir.z != 0 ? 1.f / LocalDir.z : FLT_MAX,
+    };
+    return InstanceBVH::IntersectRayAABB(float3{LocalOrigin.x, LocalOrigin.y, LocalOrigin.z}, InvDir,
+                                         float3{-1, -1, -1}, float3{1, 1, 1}, FLT_MAX, Dist);
+}
+
+} // namespace
+
 SampleBase* CreateSample()
 {
     return new Tutorial04_Instancing();
 }
 
+Tutorial04_Instancing::~Tutorial04_Instancing()
+{
+    // Terminar de escribir la grabación si se cierra la aplicación mientras graba
+    m_Recorder.Stop(m_pImmediateContext);
+}
+
 void Tutorial04_Instancing::CreatePipelineState()
 {
     // clang-format off
@@ -94,7 +136,7 @@ void Tutorial04_Instancing::CreatePipelineState()
 
     // Create dynamic uniform buffer that will store our transformation matrix
     // Dynamic buffers can be frequently updated by the CPU
-    CreateUniformBuffer(m_pDevice, sizeof(float4x4) * 2, "VS constants CB", &m_VSConstants);
+    CreateUniformBuffer(m_pDevice, sizeof(VSConstants), "VS constants CB", &m_VSConstants);
 
     // Since we did not explicitly specify the type for 'Constants' variable, default
     // type (SHADER_RESOURCE_VARIABLE_TYPE_STATIC) will be used. Static variables
@@ -104,6 +146,126 @@ void Tutorial04_Instancing::CreatePipelineState()
     // Since we are using mutable variable, we must create a shader resource binding object
     // http://diligentgraphics.com/2016/03/23/resource-binding-model-in-diligent-engine-2-0/
     m_pPSO->CreateShaderResourceBinding(&m_SRB, true);
+
+    // g_Mobiles es un buffer estructurado leído en el vertex shader, lo que en OpenGL
+    // requiere storage buffers (GL 4.3 / GLES 3.1, igual que los compute shaders).
+    // En macOS (GL 4.1), GLES 3.0 y WebGL el modo en dos niveles no está disponible
+    if (m_pDevice->GetDeviceInfo().Features.ComputeShaders)
+        CreateTwoLevelPipelineState(pShaderSourceFactory);
+}
+
+void Tutorial04_Instancing::CreateTwoLevelPipelineState(IShaderSourceInputStreamFactory* pShaderSourceFactory)
+{
+    // Mismos shaders que el PSO principal, pero con TWO_LEVEL_INSTANCING definido:
+    // las piezas se leen de la plantilla y de los registros por móvil en lugar de
+    // recibir una matriz por instancia. TexturedCube no permite añadir macros,
+    // así que este PSO se crea a mano.
+    GraphicsPipelineStateCreateInfo PSOCreateInfo;
+
+    PSOCreateInfo.PSODesc.Name         = "Two-level instancing PSO";
+    PSOCreateInfo.PSODesc.PipelineType = PIPELINE_TYPE_GRAPHICS;
+
+    // clang-format off
+    PSOCreateInfo.GraphicsPipeline.NumRenderTargets             = 1;
+    PSOCreateInfo.GraphicsPipeline.RTVFormats[0]                = m_pSwapChain->GetDesc().ColorBufferFormat;
+    PSOCreateInfo.GraphicsPipeline.DSVFormat                    = m_pSwapChain->GetDesc().DepthBufferFormat;
+    PSOCreateInfo.GraphicsPipeline.PrimitiveTopology            = PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    PSOCreateInfo.GraphicsPipeline.RasterizerDesc.CullMode      = CULL_MODE_BACK;
+    PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.DepthEnable = True;
+    // clang-format on
+
+    ShaderCreateInfo ShaderCI;
+    ShaderCI.SourceLanguage                  = SHADER_SOURCE_LANGUAGE_HLSL;
+    ShaderCI.Desc.UseCombinedTextureSamplers = true;
+    // Pack matrices in row-major order
+    ShaderCI.CompileFlags               = SHADER_COMPILE_FLAG_PACK_MATRIX_ROW_MAJOR;
+    ShaderCI.pShaderSourceStreamFactory = pShaderSourceFactory;
+
+    ShaderMacro Macros[] = {{"CONVERT_PS_OUTPUT_TO_GAMMA", m_ConvertPSOutputToGamma ? "1" : "0"},
+                            {"TWO_LEVEL_INSTANCING", "1"}};
+    ShaderCI.Macros      = {Macros, _countof(Macros)};
+
+    RefCntAutoPtr<IShader> pVS;
+    {
+        ShaderCI.Desc.ShaderType = SHADER_TYPE_VERTEX;
+        ShaderCI.EntryPoint      = "main";
+        ShaderCI.Desc.Name       = "Two-level instancing VS";
+        ShaderCI.FilePath        = "cube_inst_multitex.vsh";
+        m_pDevice->CreateShader(ShaderCI, &pVS);
+    }
+
+    RefCntAutoPtr<IShader> pPS;
+    {
+        ShaderCI.Desc.ShaderType = SHADER_TYPE_PIXEL;
+        ShaderCI.EntryPoint      = "main";
+        ShaderCI.Desc.Name       = "Two-level instancing PS";
+        ShaderCI.FilePath        = "cube_inst_multitex.psh";
+        m_pDevice->CreateShader(ShaderCI, &pPS);
+    }
+    if (!pVS || !pPS)
+    {
+        LOG_WARNING_MESSAGE("Failed to compile the two-level instancing shaders: two-level instancing is disabled");
+        return;
+    }
+
+    // clang-format off
+    // Solo datos por vértice: los datos por instancia se obtienen con SV_InstanceID
+    LayoutElement LayoutElems[] =
+    {
+        // Attribute 0 - vertex position
+        LayoutElement{0, 0, 3, VT_FLOAT32, False},
+        // Attribute 1 - texture coordinates
+        LayoutElement{1, 0, 2, VT_FLOAT32, False}
+    };
+    // clang-format on
+    PSOCreateInfo.GraphicsPipeline.InputLayout.LayoutElements = LayoutElems;
+    PSOCreateInfo.GraphicsPipeline.InputLayout.NumElements    = _countof(LayoutElems);
+
+    PSOCreateInfo.pVS = pVS;
+    PSOCreateInfo.pPS = pPS;
+
+    PSOCreateInfo.PSODesc.ResourceLayout.DefaultVariableType = SHADER_RESOURCE_VARIABLE_TYPE_STATIC;
+
+    // clang-format off
+    // g_Mobiles es dinámica porque el buffer se recrea cuando el pool crece
+    ShaderResourceVariableDesc Vars[] =
+    {
+        {SHADER_TYPE_VERTEX, "g_Mobiles",       SHADER_RESOURCE_VARIABLE_TYPE_DYNAMIC},
+        {SHADER_TYPE_PIXEL,  "g_Texture",       SHADER_RESOURCE_VARIABLE_TYPE_MUTABLE},
+        {SHADER_TYPE_PIXEL,  "g_TextureDetail", SHADER_RESOURCE_VARIABLE_TYPE_MUTABLE},
+        {SHADER_TYPE_PIXEL,  "g_TextureBlend",  SHADER_RESOURCE_VARIABLE_TYPE_MUTABLE},
+        {SHADER_TYPE_PIXEL,  "g_TextureAlt",    SHADER_RESOURCE_VARIABLE_TYPE_MUTABLE}
+    };
+    // clang-format on
+    PSOCreateInfo.PSODesc.ResourceLayout.Variables    = Vars;
+    PSOCreateInfo.PSODesc.ResourceLayout.NumVariables = _countof(Vars);
+
+    // clang-format off
+    SamplerDesc SamLinearClampDesc
+    {
+        FILTER_TYPE_LINEAR, FILTER_TYPE_LINEAR, FILTER_TYPE_LINEAR,
+        TEXTURE_ADDRESS_CLAMP, TEXTURE_ADDRESS_CLAMP, TEXTURE_ADDRESS_CLAMP
+    };
+    ImmutableSamplerDesc ImtblSamplers[] =
+    {
+        {SHADER_TYPE_PIXEL, "g_Texture", SamLinearClampDesc}
+    };
+    // clang-format on
+    PSOCreateInfo.PSODesc.ResourceLayout.ImmutableSamplers    = ImtblSamplers;
+    PSOCreateInfo.PSODesc.ResourceLayout.NumImmutableSamplers = _countof(ImtblSamplers);
+
+    m_pDevice->CreateGraphicsPipelineState(PSOCreateInfo, &m_pTwoLevelPSO);
+    if (!m_pTwoLevelPSO)
+    {
+        // Algunos dispositivos GLES 3.1 no admiten storage buffers en el vertex shader
+        LOG_WARNING_MESSAGE("Failed to create the two-level instancing PSO: two-level instancing is disabled");
+        return;
+    }
+
+    m_pTwoLevelPSO->GetStaticVariableByName(SHADER_TYPE_VERTEX, "Constants")->Set(m_VSConstants);
+    m_pTwoLevelPSO->GetStaticVariableByName(SHADER_TYPE_VERTEX, "MobileTemplate")->Set(m_MobileTemplateCB);
+
+    m_pTwoLevelPSO->CreateShaderResourceBinding(&m_TwoLevelSRB, true);
 }
 
 void Tutorial04_Instancing::CreateInstanceBuffer()
@@ -111,15 +273,97 @@ void Tutorial04_Instancing::CreateInstanceBuffer()
     // Create instance data buffer that will store transformation matrices and instance IDs
     BufferDesc InstBuffDesc;
     InstBuffDesc.Name = "Instance data buffer";
-    // Use default usage as this buffer will only be updated when grid size changes
+    // Use default usage as only the modified ranges of this buffer are updated
     InstBuffDesc.Usage     = USAGE_DEFAULT;
     InstBuffDesc.BindFlags = BIND_VERTEX_BUFFER;
-    // Aumentamos el tamaño para incluir el ID de instancia (uint32)
-    InstBuffDesc.Size      = sizeof(float4x4) * MaxInstances + sizeof(Uint32) * MaxInstances;
-    m_pDevice->CreateBuffer(InstBuffDesc, nullptr, &m_InstanceBuffer);
+    // El tamaño lo gestiona el pool: empieza con capacidad para unos pocos móviles
+    // y crece de forma geométrica cuando hace falta
+    m_InstancePool.Initialize(InstBuffDesc, NumMobilePieces * 4);
+
+    // Registros por móvil para la instanciación en dos niveles.
+    // Se leen en el vertex shader como buffer estructurado indexado con SV_InstanceID
+    BufferDesc MobileBuffDesc;
+    MobileBuffDesc.Name              = "Mobile root buffer";
+    MobileBuffDesc.Usage             = USAGE_DEFAULT;
+    MobileBuffDesc.BindFlags         = BIND_SHADER_RESOURCE;
+    MobileBuffDesc.Mode              = BUFFER_MODE_STRUCTURED;
+    MobileBuffDesc.ElementByteStride = sizeof(MobileData);
+    m_MobileRootPool.Initialize(MobileBuffDesc, 16);
+
+    UpdateMobilePieces();
+    SpawnMobile();
+    UpdateWorldTransforms();
     PopulateInstanceBuffer();
 }
 
+void Tutorial04_Instancing::SpawnMobile()
+{
+    if (m_InstancePool.GetCount() + NumMobilePieces > static_cast<Uint32>(MaxInstances))
+        return;
+
+    MobileInstance Mobile;
+    if (!m_FreeMobileCells.empty())
+    {
+        Mobile.Cell = m_FreeMobileCells.back();
+        m_FreeMobileCells.pop_back();
+    }
+    else
+    {
+        Mobile.Cell = m_NextMobileCell++;
+    }
+
+    Mobile.Position = GetMobileCellPosition(Mobile.Cell);
+
+    const float4x4 RootMatrix = float4x4::Translation(Mobile.Position);
+    for (Uint32 i = 0; i < NumMobilePieces; ++i)
+    {
+        InstanceData Piece = m_MobilePieces[i];
+        Piece.Transform    = Piece.Transform * RootMatrix;
+        Mobile.Pieces[i]   = m_InstancePool.Add(Piece);
+    }
+
+    MobileData Root;
+    Root.RootPosScale = float4{Mobile.Position, 1.0f};
+    Root.TierAngles   = float4{m_MainRotation, m_FirstTierRotation, m_SecondTierRotation, 0.0f};
+    Mobile.Root       = m_MobileRootPool.Add(Root);
+
+    // Solo se inserta en el BVH el subárbol de las piezas de este móvil
+    UpdateMobileWorldTransforms(Mobile.Cell, Mobile.Position);
+    const auto StartTime = std::chrono::high_resolution_clock::now();
+    Mobile.PickingGroup  = m_PickingBVH.InsertGroup(m_WorldBounds, Mobile.Cell * NumMobilePieces, NumMobilePieces);
+    m_BVHUpdateTime      = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - StartTime).count();
+
+    m_Mobiles.push_back(Mobile);
+}
+
+float3 Tutorial04_Instancing::GetMobileCellPosition(Uint32 Cell)
+{
+    // La celda 0 queda en el origen; el resto se reparte en una rejilla sobre el plano XZ
+    return float3{static_cast<float>(Cell % MaxGridSize) * MobileSpacing,
+                  0.0f,
+                  -static_cast<float>(Cell / MaxGridSize) * MobileSpacing};
+}
+
+void Tutorial04_Instancing::DespawnMobile(size_t MobileIdx)
+{
+    if (MobileIdx >= m_Mobiles.size())
+        return;
+
+    MobileInstance& Mobile = m_Mobiles[MobileIdx];
+    for (const auto& Piece : Mobile.Pieces)
+        m_InstancePool.Remove(Piece);
+    m_MobileRootPool.Remove(Mobile.Root);
+    m_FreeMobileCells.push_back(Mobile.Cell);
+
+    const auto StartTime = std::chrono::high_resolution_clock::now();
+    m_PickingBVH.RemoveGroup(Mobile.PickingGroup);
+    m_BVHUpdateTime = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - StartTime).count();
+
+    // Swap-remove también en la lista de móviles
+    Mobile = m_Mobiles.back();
+    m_Mobiles.pop_back();
+}
+
 // Manejo de eventos nativos (mouse, teclado, etc.)
 bool Tutorial04_Instancing::HandleNativeMessage(const void* pNativeMsgData)
 {
@@ -267,10 +511,24 @@ void Tutorial04_Instancing::HandleMouseEvent(int x, int y, bool buttonDown, bool
     }
 }
 
+void Tutorial04_Instancing::ModifyEngineInitInfo(const ModifyEngineInitInfoAttribs& Attribs)
+{
+    SampleBase::ModifyEngineInitInfo(Attribs);
+
+    // Necesario para el buffer estructurado del modo en dos niveles (ver CreatePipelineState)
+    Attribs.EngineCI.Features.ComputeShaders = DEVICE_FEATURE_STATE_OPTIONAL;
+    // Para medir en la GPU el coste de la grabación
+    Attribs.EngineCI.Features.DurationQueries = DEVICE_FEATURE_STATE_OPTIONAL;
+    // La grabación copia el back buffer a texturas staging (TRANSFER_SRC en Vulkan)
+    Attribs.SCDesc.Usage |= SWAP_CHAIN_USAGE_COPY_SOURCE;
+}
+
 void Tutorial04_Instancing::Initialize(const SampleInitInfo& InitInfo)
 {
     SampleBase::Initialize(InitInfo);
 
+    // La plantilla del móvil se necesita antes de crear el PSO en dos niveles
+    CreateMobileTemplate();
     CreatePipelineState();
 
     // Load textured cube
@@ -289,6 +547,14 @@ void Tutorial04_Instancing::Initialize(const SampleInitInfo& InitInfo)
     m_SRB->GetVariableByName(SHADER_TYPE_PIXEL, "g_TextureBlend")->Set(m_TextureBlendSRV);
     m_SRB->GetVariableByName(SHADER_TYPE_PIXEL, "g_TextureAlt")->Set(m_TextureAltSRV);
 
+    if (m_TwoLevelSRB)
+    {
+        m_TwoLevelSRB->GetVariableByName(SHADER_TYPE_PIXEL, "g_Texture")->Set(m_TextureSRV);
+        m_TwoLevelSRB->GetVariableByName(SHADER_TYPE_PIXEL, "g_TextureDetail")->Set(m_TextureDetailSRV);
+        m_TwoLevelSRB->GetVariableByName(SHADER_TYPE_PIXEL, "g_TextureBlend")->Set(m_TextureBlendSRV);
+        m_TwoLevelSRB->GetVariableByName(SHADER_TYPE_PIXEL, "g_TextureAlt")->Set(m_TextureAltSRV);
+    }
+
     CreateInstanceBuffer();
     
     // Inicializar las vistas de cámara
@@ -363,7 +629,7 @@ void Tutorial04_Instancing::UpdateUI()
     
     // Ventana 3: Cámara Libre
     ImGui::SetNextWindowPos(ImVec2(630, 10), ImGuiCond_FirstUseEver);
-    ImGui::SetNextWindowSize(ImVec2(300, 200), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowSize(ImVec2(300, 400), ImGuiCond_FirstUseEver);
     if (ImGui::Begin("Ventana 3: Cámara Libre", nullptr))
     {
         ImGui::Text("Control de posición de cámara:");
@@ -384,64 +650,220 @@ void Tutorial04_Instancing::UpdateUI()
         
         // Control de escala para el zoom
         ImGui::SliderFloat("Zoom", &CameraWindow3.ViewZoom, 0.01f, 0.5f, "%.3f");
+
+        ImGui::Separator();
+
+        // Selección de objetos
+        ImGui::Text("Selección (clic en la ventana):");
+        if (m_MobileRootPool.IsAlive(m_Selection.Root))
+            ImGui::Text("Móvil %u, pieza %u", m_Selection.Cell, m_Selection.PieceIdx);
+        else
+            ImGui::Text("Ninguna");
+        ImGui::Text("BVH: %u nodos", m_PickingBVH.GetNumNodes());
+        ImGui::Text("Alta/baja: %.3f ms  Refit: %.3f ms", m_BVHUpdateTime * 1000.0, m_BVHRefitTime * 1000.0);
+
+        if (ImGui::Button("Benchmark BVH"))
+            RunPickingBenchmark();
+        for (const auto& Result : m_PickingBenchmark)
+        {
+            ImGui::Text("%5u inst: build %.3f ms, alta+baja %.3f ms, refit %.3f ms", Result.NumInstances,
+                        Result.BuildTime * 1000.0, Result.UpdateTime * 1000.0, Result.RefitTime * 1000.0);
+            ImGui::Text("           rayo %.2f us (fuerza bruta %.2f us)", Result.QueryTime * 1e6, Result.BruteForceTime * 1e6);
+        }
+    }
+    ImGui::End();
+
+    // Instancias: creación y eliminación de móviles en tiempo de ejecución
+    ImGui::SetNextWindowPos(ImVec2(10, 170), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowSize(ImVec2(300, 170), ImGuiCond_FirstUseEver);
+    if (ImGui::Begin("Instancias", nullptr))
+    {
+        if (ImGui::Button("Añadir móvil"))
+            SpawnMobile();
+        ImGui::SameLine();
+        if (ImGui::Button("Añadir 10"))
+        {
+            for (int i = 0; i < 10; ++i)
+                SpawnMobile();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Quitar móvil") && !m_Mobiles.empty())
+        {
+            // Quitamos un móvil al azar para que el pool tenga que compactar
+            static std::mt19937 gen;
+            std::uniform_int_distribution<size_t> dist(0, m_Mobiles.size() - 1);
+            DespawnMobile(dist(gen));
+        }
+
+        ImGui::Text("Móviles: %d", static_cast<int>(m_Mobiles.size()));
+        ImGui::Text("Instancias: %u / %u", m_InstancePool.GetCount(), m_InstancePool.GetCapacity());
+
+        if (m_pTwoLevelPSO)
+            ImGui::Checkbox("Instanciación en dos niveles", &m_TwoLevelInstancing);
+        else
+            ImGui::TextDisabled("Instanciación en dos niveles: no disponible");
+        const Uint64 UploadBytes  = m_InstancePool.GetLastUploadBytes() + m_MobileRootPool.GetLastUploadBytes();
+        const Uint32 UploadRanges = m_InstancePool.GetLastUploadRanges() + m_MobileRootPool.GetLastUploadRanges();
+        ImGui::Text("Subido último frame: %.1f KB en %u tramos", static_cast<double>(UploadBytes) / 1024.0, UploadRanges);
+    }
+    ImGui::End();
+
+    UpdateRecorderUI();
+
+    // Selección con clic (sin arrastrar) en la ventana 3. Se usa la entrada de ImGui
+    // en lugar de HandleNativeMessage para que funcione en todas las plataformas
+    const ImGuiIO& io = ImGui::GetIO();
+    if (!io.WantCaptureMouse && ImGui::IsMouseReleased(0) && io.DisplaySize.x > 0 && io.DisplaySize.y > 0)
+    {
+        const float DragX = io.MousePos.x - io.MouseClickedPos[0].x;
+        const float DragY = io.MousePos.y - io.MouseClickedPos[0].y;
+        if (DragX * DragX + DragY * DragY < 9.0f)
+        {
+            const auto& SCDesc = m_pSwapChain->GetDesc();
+            PickInstance(io.MousePos.x * static_cast<float>(SCDesc.Width) / io.DisplaySize.x,
+                         io.MousePos.y * static_cast<float>(SCDesc.Height) / io.DisplaySize.y);
+        }
+    }
+}
+
+void Tutorial04_Instancing::UpdateRecorderUI()
+{
+    ImGui::SetNextWindowPos(ImVec2(320, 170), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowSize(ImVec2(300, 200), ImGuiCond_FirstUseEver);
+    if (ImGui::Begin("Grabación", nullptr))
+    {
+        const bool IsRecording = m_Recorder.IsRecording();
+        if (!IsRecording)
+        {
+            int Format = static_cast<int>(m_RecordFormat);
+            ImGui::Combo("Formato", &Format, "Secuencia PNG\0GIF animado\0");
+            m_RecordFormat = static_cast<FrameRecorder::OutputFormat>(Format);
+            ImGui::SliderInt("Reducción", &m_RecordDownscale, 1, 4);
+        }
+
+        if (ImGui::Button(IsRecording ? "Detener" : "Grabar"))
+        {
+            if (IsRecording)
+            {
+                m_Recorder.Stop(m_pImmediateContext);
+            }
+            else
+            {
+                const auto& SCDesc = m_pSwapChain->GetDesc();
+
+                FrameRecorder::StartInfo Info;
+                Info.pDevice   = m_pDevice;
+                Info.Width     = SCDesc.Width;
+                Info.Height    = SCDesc.Height;
+                Info.Format    = SCDesc.ColorBufferFormat;
+                Info.Usage     = SCDesc.Usage;
+                Info.Output    = m_RecordFormat;
+                Info.Downscale = static_cast<Uint32>(m_RecordDownscale);
+                m_Recorder.Start(Info);
+            }
+        }
+
+        const auto Stats = m_Recorder.GetStatistics();
+        ImGui::Text("Capturados: %u  Codificados: %u", Stats.CapturedFrames, Stats.EncodedFrames);
+        ImGui::Text("Descartados: %u  Fusionados (GIF): %u", Stats.DroppedFrames, Stats.MergedFrames);
+        // Coste de la captura respecto a la duración del fotograma: en el hilo de render
+        // (lectura de las copias terminadas) y en la GPU (copia del back buffer)
+        auto FramePercent = [this](double Time) {
+            return m_AvgFrameTime > 0 ? Time / m_AvgFrameTime * 100.0 : 0.0;
+        };
+        ImGui::Text("Coste CPU: %.3f ms (%.1f%% del fotograma)", Stats.AvgCaptureTime * 1000.0, FramePercent(Stats.AvgCaptureTime));
+        if (Stats.GpuTimingAvailable)
+            ImGui::Text("Coste GPU: %.3f ms (%.1f%% del fotograma)", Stats.AvgGpuCopyTime * 1000.0, FramePercent(Stats.AvgGpuCopyTime));
+        else
+            ImGui::TextDisabled("Coste GPU: sin consultas de duración");
     }
     ImGui::End();
 }
 
 void Tutorial04_Instancing::PopulateInstanceBuffer()
 {
-    // Estructura para combinar datos de matriz y tipo de objeto
-    struct InstanceData {
-        float4x4 Transform;
-        Uint32   ObjectType;  // Tipo de objeto para aplicar diferentes efectos
-    };
+    if (m_TwoLevelInstancing)
+    {
+        // Modo en dos niveles: solo se sube un registro pequeño por móvil,
+        // las piezas se componen en el vertex shader a partir de la plantilla
+        for (const auto& Mobile : m_Mobiles)
+        {
+            MobileData Data;
+            Data.RootPosScale = float4{Mobile.Position, 1.0f};
+            Data.TierAngles   = float4{m_MainRotation, m_FirstTierRotation, m_SecondTierRotation, 0.0f};
+            m_MobileRootPool.Update(Mobile.Root, Data);
+        }
+    }
+    else
+    {
+        // Las piezas ya compuestas con la posición de cada móvil están en m_WorldTransforms.
+        // Solo se escriben las entradas del pool que cambian; Flush() sube los tramos modificados
+        for (const auto& Mobile : m_Mobiles)
+        {
+            for (Uint32 i = 0; i < NumMobilePieces; ++i)
+            {
+                // Las piezas fijas (base y palo central) no giran: su transformación
+                // se escribe al crear el móvil y no vuelve a cambiar
+                if (m_MobileTemplate[i].Tier == 0)
+                    continue;
 
-    std::vector<InstanceData> InstanceDataArray(MaxInstances);
-    int instId = 0;
+                InstanceData Piece;
+                Piece.Transform  = m_WorldTransforms[Mobile.Cell * NumMobilePieces + i];
+                Piece.ObjectType = m_MobilePieces[i].ObjectType;
+                m_InstancePool.Update(Mobile.Pieces[i], Piece);
+            }
+        }
+    }
 
-    // Ángulos de rotación para diferentes partes
-    static float mainRotation = 0.0f;          // Rotación principal del móvil
-    static float firstTierRotation = 0.0f;     // Rotación del primer nivel
-    static float secondTierRotation = 0.0f;    // Rotación del segundo nivel
+    m_InstancePool.Flush(m_pDevice, m_pImmediateContext);
+    // Sin el PSO en dos niveles el buffer estructurado de raíces no se crea nunca
+    if (m_pTwoLevelPSO && m_MobileRootPool.Flush(m_pDevice, m_pImmediateContext))
+    {
+        // El buffer se ha recreado al crecer: hay que volver a enlazar su vista
+        IBufferView* pMobilesSRV = m_MobileRootPool.GetBuffer()->GetDefaultView(BUFFER_VIEW_SHADER_RESOURCE);
+        m_TwoLevelSRB->GetVariableByName(SHADER_TYPE_VERTEX, "g_Mobiles")->Set(pMobilesSRV);
+    }
+}
 
-    // Actualizar ángulos con velocidades diferenciadas
-    mainRotation += 0.003f;                    // Rotación base más lenta
-    firstTierRotation += 0.005f;               // Primer nivel gira un poco más rápido
-    secondTierRotation += 0.007f;              // Segundo nivel gira más rápido aún
+void Tutorial04_Instancing::CreateMobileTemplate()
+{
+    // La plantilla guarda cada pieza en espacio local junto con el nivel al que
+    // pertenece; la rotación de cada nivel se aplica después (en CPU o en el shader)
+    static_assert(sizeof(MobilePieceTemplate) == sizeof(float4x4) + sizeof(uint4), "MobilePieceTemplate must match MobilePiece in cube_inst_multitex.vsh");
+
+    MobilePieceTemplate* InstanceDataArray = m_MobileTemplate.data();
+    Uint32               instId            = 0;
 
     // Base principal (placa superior) - Tipo 0: Efecto de base
     float4x4 baseMatrix = float4x4::Scale(1.6f, 0.1f, 1.6f) * float4x4::Translation(0.0f, 4.8f, 0.0f);
-    InstanceDataArray[instId].Transform = baseMatrix;
+    InstanceDataArray[instId].Local = baseMatrix;
     InstanceDataArray[instId].ObjectType = 0;
+    InstanceDataArray[instId].Tier = 0;
     instId++;
 
-    // Matrices de rotación para los diferentes niveles
-    float4x4 mainRotMatrix = float4x4::RotationY(mainRotation);
-    float4x4 firstLevelMatrix = mainRotMatrix * float4x4::RotationY(firstTierRotation);
-    float4x4 secondLevelMatrix = firstLevelMatrix * float4x4::RotationY(secondTierRotation);
-
     // === PRIMER NIVEL ===
     // Palo central vertical - Tipo 1: Efecto para conectores
     float4x4 centerPoleMatrix = float4x4::Scale(0.1f, 1.0f, 0.1f) * float4x4::Translation(0.0f, 3.65f, 0.0f);
-    InstanceDataArray[instId].Transform = centerPoleMatrix;
+    InstanceDataArray[instId].Local = centerPoleMatrix;
     InstanceDataArray[instId].ObjectType = 1;
+    InstanceDataArray[instId].Tier = 0;
     instId++;
 
     // Brazos horizontales del primer nivel - Alternar entre subtipos de conectores
     float4x4 horizontalArm1 = float4x4::Scale(3.6f, 0.1f, 0.1f) *
-                             float4x4::Translation(0.0f, 2.6f, 0.0f) *
-                             firstLevelMatrix;
+                             float4x4::Translation(0.0f, 2.6f, 0.0f);
     float4x4 horizontalArm2 = float4x4::Scale(0.1f, 0.1f, 3.6f) *
-                             float4x4::Translation(0.0f, 2.6f, 0.0f) *
-                             firstLevelMatrix;
+                             float4x4::Translation(0.0f, 2.6f, 0.0f);
     
     // Asignar subtipos diferentes para variedad visual
-    InstanceDataArray[instId].Transform = horizontalArm1;
+    InstanceDataArray[instId].Local = horizontalArm1;
     InstanceDataArray[instId].ObjectType = 1;
+    InstanceDataArray[instId].Tier = 1;
     instId++;
     
-    InstanceDataArray[instId].Transform = horizontalArm2;
+    InstanceDataArray[instId].Local = horizontalArm2;
     InstanceDataArray[instId].ObjectType = 1;
+    InstanceDataArray[instId].Tier = 1;
     instId++;
 
     // Cubos del primer nivel - Tipos 3-6 para variación de texturas por cubo
@@ -456,9 +878,10 @@ void Tutorial04_Instancing::PopulateInstanceBuffer()
     Uint32 cubeTypes[] = {3, 4, 5, 6};
 
     for (int i = 0; i < static_cast<int>(sizeof(cubePositions)/sizeof(cubePositions[0])); i++) {
-        float4x4 cubeMatrix = float4x4::Scale(0.6f, 0.6f, 0.6f) * cubePositions[i] * firstLevelMatrix;
-        InstanceDataArray[instId].Transform = cubeMatrix;
+        float4x4 cubeMatrix = float4x4::Scale(0.6f, 0.6f, 0.6f) * cubePositions[i];
+        InstanceDataArray[instId].Local = cubeMatrix;
         InstanceDataArray[instId].ObjectType = cubeTypes[i % 4];
+        InstanceDataArray[instId].Tier = 1;
         instId++;
     }
 
@@ -472,9 +895,10 @@ void Tutorial04_Instancing::PopulateInstanceBuffer()
     };
 
     for (int i = 0; i < static_cast<int>(sizeof(verticalConnectors)/sizeof(verticalConnectors[0])); i++) {
-        InstanceDataArray[instId].Transform = verticalConnectors[i] * secondLevelMatrix;
+        InstanceDataArray[instId].Local = verticalConnectors[i];
         // Pequeña variación para tener efectos ligeramente diferentes
         InstanceDataArray[instId].ObjectType = 1;
+        InstanceDataArray[instId].Tier = 2;
         instId++;
     }
 
@@ -487,8 +911,9 @@ void Tutorial04_Instancing::PopulateInstanceBuffer()
     };
 
     for (int i = 0; i < static_cast<int>(sizeof(secondLevelArms)/sizeof(secondLevelArms[0])); i++) {
-        InstanceDataArray[instId].Transform = secondLevelArms[i] * secondLevelMatrix;
+        InstanceDataArray[instId].Local = secondLevelArms[i];
         InstanceDataArray[instId].ObjectType = 1;
+        InstanceDataArray[instId].Tier = 2;
         instId++;
     }
 
@@ -505,23 +930,284 @@ void Tutorial04_Instancing::PopulateInstanceBuffer()
     };
 
     for (int i = 0; i < static_cast<int>(sizeof(secondTierPositions)/sizeof(secondTierPositions[0])); i++) {
-        float4x4 cubeMatrix = float4x4::Scale(0.6f, 0.6f, 0.6f) * secondTierPositions[i] * secondLevelMatrix;
-        InstanceDataArray[instId].Transform = cubeMatrix;
+        float4x4 cubeMatrix = float4x4::Scale(0.6f, 0.6f, 0.6f) * secondTierPositions[i];
+        InstanceDataArray[instId].Local = cubeMatrix;
         // En lugar de usar el tipo 2 genérico, asignamos valores específicos
         InstanceDataArray[instId].ObjectType = 3 + (i % 6); // Variación de 3 a 8
+        InstanceDataArray[instId].Tier = 2;
         instId++;
     }
 
-    // Actualizar el buffer
-    Uint32 DataSize = static_cast<Uint32>(sizeof(InstanceData) * instId);
-    m_pImmediateContext->UpdateBuffer(m_InstanceBuffer, 0, DataSize, InstanceDataArray.data(),
-                                    RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    VERIFY_EXPR(instId == NumMobilePieces);
+
+    // La plantilla no cambia nunca, así que se guarda en un buffer inmutable
+    BufferDesc CBDesc;
+    CBDesc.Name      = "Mobile template CB";
+    CBDesc.Usage     = USAGE_IMMUTABLE;
+    CBDesc.BindFlags = BIND_UNIFORM_BUFFER;
+    CBDesc.Size      = sizeof(m_MobileTemplate);
+    BufferData CBData{m_MobileTemplate.data(), sizeof(m_MobileTemplate)};
+    m_pDevice->CreateBuffer(CBDesc, &CBData, &m_MobileTemplateCB);
+}
+
+void Tutorial04_Instancing::UpdateMobilePieces()
+{
+    // Actualizar ángulos con velocidades diferenciadas
+    m_MainRotation += 0.003f;       // Rotación base más lenta
+    m_FirstTierRotation += 0.005f;  // Primer nivel gira un poco más rápido
+    m_SecondTierRotation += 0.007f; // Segundo nivel gira más rápido aún
+
+    float4x4 TierMatrices[3];
+    ComputeTierMatrices(m_MainRotation, m_FirstTierRotation, m_SecondTierRotation, TierMatrices);
+    for (Uint32 i = 0; i < NumMobilePieces; ++i)
+    {
+        const MobilePieceTemplate& Piece = m_MobileTemplate[i];
+        m_MobilePieces[i].Transform  = Piece.Local * TierMatrices[Piece.Tier];
+        m_MobilePieces[i].ObjectType = Piece.ObjectType;
+    }
+}
+
+void Tutorial04_Instancing::ComputeTierMatrices(float MainRotation, float FirstTierRotation, float SecondTierRotation, float4x4 TierMatrices[3])
+{
+    // Matrices de rotación para los diferentes niveles
+    float4x4 mainRotMatrix = float4x4::RotationY(MainRotation);
+    float4x4 firstLevelMatrix = mainRotMatrix * float4x4::RotationY(FirstTierRotation);
+    float4x4 secondLevelMatrix = firstLevelMatrix * float4x4::RotationY(SecondTierRotation);
+
+    TierMatrices[0] = float4x4::Identity();
+    TierMatrices[1] = firstLevelMatrix;
+    TierMatrices[2] = secondLevelMatrix;
+}
+
+void Tutorial04_Instancing::UpdateMobileWorldTransforms(Uint32 Cell, const float3& Position)
+{
+    const size_t NumPieces = size_t{m_NextMobileCell} * NumMobilePieces;
+    if (m_WorldTransforms.size() < NumPieces)
+    {
+        m_WorldTransforms.resize(NumPieces);
+        m_WorldBounds.resize(NumPieces);
+    }
+
+    const float4x4 RootMatrix = float4x4::Translation(Position);
+    for (Uint32 i = 0; i < NumMobilePieces; ++i)
+    {
+        const size_t Idx       = size_t{Cell} * NumMobilePieces + i;
+        m_WorldTransforms[Idx] = m_MobilePieces[i].Transform * RootMatrix;
+        // El vertex shader aplica g_Rotation antes que la matriz de la instancia
+        m_WorldBounds[Idx] = ComputePieceBounds(m_RotationMatrix * m_WorldTransforms[Idx]);
+    }
+}
+
+void Tutorial04_Instancing::UpdateWorldTransforms()
+{
+    for (const auto& Mobile : m_Mobiles)
+        UpdateMobileWorldTransforms(Mobile.Cell, Mobile.Position);
+
+    // Los niveles del móvil giran de forma continua, así que basta con reajustar las
+    // cajas del BVH; los móviles nuevos o eliminados ya se han insertado o quitado
+    const auto StartTime = std::chrono::high_resolution_clock::now();
+    m_PickingBVH.Refit(m_WorldBounds);
+    m_BVHRefitTime = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - StartTime).count();
+}
+
+void Tutorial04_Instancing::PickInstance(float x, float y)
+{
+    const auto& SCDesc = m_pSwapChain->GetDesc();
+
+    // Mismo viewport que en Render()
+    const float VPLeft  = static_cast<float>(2 * SCDesc.Width / 3);
+    const float VPWidth = static_cast<float>(SCDesc.Width / 3);
+    if (x < VPLeft || x >= VPLeft + VPWidth)
+        return;
+
+    const float NdcX = (x - VPLeft) / VPWidth * 2.0f - 1.0f;
+    const float NdcY = 1.0f - y / static_cast<float>(SCDesc.Height) * 2.0f;
+
+    // Desproyectar el punto del ratón en los planos cercano y lejano con la misma
+    // matriz view-projection que usa la ventana 3
+    auto SrfPreTransform = GetSurfacePretransformMatrix(float3{0, 0, 1});
+    auto Proj            = GetAdjustedProjectionMatrix(PI_F / 4.0f, 0.1f, 100.f);
+
+    const float4x4 InvViewProj = (ViewWindow3 * SrfPreTransform * Proj).Inverse();
+    const float    NearZ       = m_pDevice->GetDeviceInfo().GetNDCAttribs().MinZ;
+
+    const float4 NearPos = float4{NdcX, NdcY, NearZ, 1.0f} * InvViewProj;
+    const float4 FarPos  = float4{NdcX, NdcY, 1.0f, 1.0f} * InvViewProj;
+    const float3 Origin  = float3{NearPos.x, NearPos.y, NearPos.z} / NearPos.w;
+    const float3 Dir     = float3{FarPos.x, FarPos.y, FarPos.z} / FarPos.w - Origin;
+
+    Uint32 HitPrim = 0;
+    float  HitDist = 0;
+    auto   PrimTest = [&](Uint32 PrimIdx, float& Dist) {
+        return IntersectRayPiece(m_RotationMatrix * m_WorldTransforms[PrimIdx], Origin, Dir, Dist);
+    };
+    m_Selection = SelectionInfo{};
+    if (!m_PickingBVH.RayCast(Origin, Dir, PrimTest, HitPrim, HitDist))
+        return;
+
+    // Las primitivas del BVH se indexan por celda, que no cambia al compactar m_Mobiles
+    const Uint32 Cell  = HitPrim / NumMobilePieces;
+    const auto   MobIt = std::find_if(m_Mobiles.begin(), m_Mobiles.end(), [Cell](const MobileInstance& Mobile) { return Mobile.Cell == Cell; });
+    if (MobIt == m_Mobiles.end())
+        return;
+
+    m_Selection.PieceIdx = HitPrim % NumMobilePieces;
+    m_Selection.Root     = MobIt->Root;
+    m_Selection.Piece    = MobIt->Pieces[m_Selection.PieceIdx];
+    m_Selection.Cell     = Cell;
+}
+
+Uint32 Tutorial04_Instancing::GetSelectedDrawIndex() const
+{
+    // El índice de instancia cambia según el modo y cuando los pools se compactan,
+    // por eso se calcula a partir de los handles en cada fotograma
+    if (!m_MobileRootPool.IsAlive(m_Selection.Root))
+        return ~0u;
+
+    if (m_TwoLevelInstancing)
+        return m_MobileRootPool.GetDenseIndex(m_Selection.Root) * NumMobilePieces + m_Selection.PieceIdx;
+    else
+        return m_InstancePool.GetDenseIndex(m_Selection.Piece);
+}
+
+void Tutorial04_Instancing::RunPickingBenchmark()
+{
+    using Clock = std::chrono::high_resolution_clock;
+
+    // Escenas sintéticas de 1 a MaxInstances / NumMobilePieces móviles con la
+    // misma plantilla y la misma disposición en rejilla que la escena real
+    const Uint32 MobileCounts[] = {1, 4, 16, 64, 256, 1024, MaxInstances / NumMobilePieces};
+
+    std::mt19937                          Gen{42};
+    std::uniform_real_distribution<float> AngleDist{0.0f, 2.0f * PI_F};
+
+    m_PickingBenchmark.clear();
+    for (Uint32 NumMobiles : MobileCounts)
+    {
+        const Uint32 NumInstances = NumMobiles * NumMobilePieces;
+
+        std::vector<float3> Angles(NumMobiles);
+        for (auto& a : Angles)
+            a = float3{AngleDist(Gen), AngleDist(Gen), AngleDist(Gen)};
+
+        std::vector<float4x4>          Transforms(NumInstances);
+        std::vector<InstanceBVH::AABB> Bounds(NumInstances);
+
+        auto ComputeScene = [&](Uint32 Frame) {
+            const float t = static_cast<float>(Frame);
+            for (Uint32 m = 0; m < NumMobiles; ++m)
+            {
+                float4x4 TierMatrices[3];
+                ComputeTierMatrices(Angles[m].x + t * 0.003f, Angles[m].y + t * 0.005f, Angles[m].z + t * 0.007f, TierMatrices);
+                const float4x4 RootMatrix = float4x4::Translation(GetMobileCellPosition(m));
+                for (Uint32 i = 0; i < NumMobilePieces; ++i)
+                {
+                    const Uint32 Idx = m * NumMobilePieces + i;
+                    Transforms[Idx]  = m_MobileTemplate[i].Local * TierMatrices[m_MobileTemplate[i].Tier] * RootMatrix;
+                    Bounds[Idx]      = ComputePieceBounds(Transforms[Idx]);
+                }
+            }
+        };
+
+        PickingBenchmarkResult Result;
+        Result.NumInstances = NumInstances;
+
+        // El árbol se construye insertando los móviles uno a uno, como en la escena real
+        ComputeScene(0);
+        InstanceBVH         BVH;
+        std::vector<Uint32> Groups(NumMobiles);
+        auto                StartTime = Clock::now();
+        for (Uint32 m = 0; m < NumMobiles; ++m)
+            Groups[m] = BVH.InsertGroup(Bounds, m * NumMobilePieces, NumMobilePieces);
+        Result.BuildTime = std::chrono::duration<double>(Clock::now() - StartTime).count();
+
+        // Refit durante varios fotogramas de animación (sin contar el cálculo de las cajas)
+        constexpr Uint32 NumFrames = 60;
+        for (Uint32 Frame = 1; Frame <= NumFrames; ++Frame)
+        {
+            ComputeScene(Frame);
+            StartTime = Clock::now();
+            BVH.Refit(Bounds);
+            Result.RefitTime += std::chrono::duration<double>(Clock::now() - StartTime).count();
+        }
+        Result.RefitTime /= NumFrames;
+
+        // Baja y nueva alta de móviles sueltos, el coste de crear o eliminar uno
+        constexpr Uint32                      NumUpdates = 32;
+        std::uniform_int_distribution<Uint32> MobileDist{0, NumMobiles - 1};
+        for (Uint32 u = 0; u < NumUpdates; ++u)
+        {
+            const Uint32 m = MobileDist(Gen);
+            StartTime      = Clock::now();
+            BVH.RemoveGroup(Groups[m]);
+            Groups[m] = BVH.InsertGroup(Bounds, m * NumMobilePieces, NumMobilePieces);
+            Result.UpdateTime += std::chrono::duration<double>(Clock::now() - StartTime).count();
+        }
+        Result.UpdateTime /= NumUpdates;
+
+        // Rayos desde arriba hacia puntos aleatorios de la zona ocupada por los móviles
+        const float GridWidth  = static_cast<float>(std::min<Uint32>(NumMobiles, MaxGridSize) - 1) * MobileSpacing;
+        const float GridDepth  = static_cast<float>((NumMobiles - 1) / MaxGridSize) * MobileSpacing;
+        std::uniform_real_distribution<float> XDist{-4.0f, GridWidth + 4.0f};
+        std::uniform_real_distribution<float> ZDist{-GridDepth - 4.0f, 4.0f};
+
+        constexpr Uint32 NumQueries = 256;
+        Uint32           Mismatches = 0;
+        for (Uint32 q = 0; q < NumQueries; ++q)
+        {
+            const float3 Origin{XDist(Gen), 20.0f, ZDist(Gen)};
+            const float3 Target{XDist(Gen), 0.0f, ZDist(Gen)};
+            const float3 Dir = Target - Origin;
+
+            auto PrimTest = [&](Uint32 PrimIdx, float& Dist) {
+                return IntersectRayPiece(Transforms[PrimIdx], Origin, Dir, Dist);
+            };
+
+            Uint32 HitPrim = 0;
+            float  HitDist = 0;
+            StartTime      = Clock::now();
+            BVH.RayCast(Origin, Dir, PrimTest, HitPrim, HitDist);
+            Result.QueryTime += std::chrono::duration<double>(Clock::now() - StartTime).count();
+
+            // Fuerza bruta como referencia
+            Uint32 BruteHitPrim = ~0u;
+            float  BruteHitDist = FLT_MAX;
+            StartTime           = Clock::now();
+            for (Uint32 i = 0; i < NumInstances; ++i)
+            {
+                float Dist = FLT_MAX;
+                if (PrimTest(i, Dist) && Dist < BruteHitDist)
+                {
+                    BruteHitDist = Dist;
+                    BruteHitPrim = i;
+                }
+            }
+            Result.BruteForceTime += std::chrono::duration<double>(Clock::now() - StartTime).count();
+
+            if (BruteHitPrim != HitPrim && BruteHitDist != HitDist)
+                ++Mismatches;
+        }
+        Result.QueryTime /= NumQueries;
+        Result.BruteForceTime /= NumQueries;
+
+        if (Mismatches != 0)
+            LOG_WARNING_MESSAGE("BVH picking benchmark: ", Mismatches, " of ", NumQueries, " queries differ from the brute-force result");
+
+        LOG_INFO_MESSAGE("BVH picking benchmark: ", NumInstances, " instances: build ", Result.BuildTime * 1000.0,
+                         " ms, remove+insert ", Result.UpdateTime * 1000.0, " ms, refit ", Result.RefitTime * 1000.0,
+                         " ms, query ", Result.QueryTime * 1e6, " us, brute force ", Result.BruteForceTime * 1e6, " us");
+
+        m_PickingBenchmark.push_back(Result);
+    }
 }
 
 // Actualizar parámetros del engine
 void Tutorial04_Instancing::Update(double CurrTime, double ElapsedTime)
 {
     SampleBase::Update(CurrTime, ElapsedTime);
+
+    m_FrameTime    = ElapsedTime;
+    m_AvgFrameTime = m_AvgFrameTime > 0 ? m_AvgFrameTime * 0.95 + ElapsedTime * 0.05 : ElapsedTime;
     
     UpdateUI();
 
@@ -544,6 +1230,8 @@ void Tutorial04_Instancing::Render()
     auto* pRTV = m_pSwapChain->GetCurrentBackBufferRTV();
     auto* pDSV = m_pSwapChain->GetDepthBufferDSV();
 
+    UpdateMobilePieces();
+    UpdateWorldTransforms();
     PopulateInstanceBuffer();
 
     // Clear the back buffer
@@ -592,7 +1280,8 @@ void Tutorial04_Instancing::Render()
     Viewports[2].MaxDepth = 1;
     
     // Renderizamos el móvil tres veces, una vez para cada viewport con su propia cámara
-    for (int viewIdx = 0; viewIdx < 3; viewIdx++)
+    // (si se han quitado todos los móviles no hay nada que dibujar)
+    for (int viewIdx = 0; viewIdx < 3 && !m_Mobiles.empty(); viewIdx++)
     {
         // Establecer el viewport actual
         m_pImmediateContext->SetViewports(1, &Viewports[viewIdx], SCDesc.Width, SCDesc.Height);
@@ -611,29 +1300,55 @@ void Tutorial04_Instancing::Render()
         
         // Actualizar los constantes del shader
         {
-            MapHelper<float4x4> CBConstants(m_pImmediateContext, m_VSConstants, MAP_WRITE, MAP_FLAG_DISCARD);
-            CBConstants[0] = ViewProj;
-            CBConstants[1] = m_RotationMatrix;
+            MapHelper<VSConstants> CBConstants(m_pImmediateContext, m_VSConstants, MAP_WRITE, MAP_FLAG_DISCARD);
+            CBConstants->ViewProj  = ViewProj;
+            CBConstants->Rotation  = m_RotationMatrix;
+            // La pieza seleccionada solo se resalta en la ventana 3
+            CBConstants->Selection = uint4{viewIdx == 2 ? GetSelectedDrawIndex() : ~0u, 0, 0, 0};
         }
 
-        // Bind vertex, instance and index buffers
-        const Uint64 offsets[] = {0, 0};
-        IBuffer*     pBuffs[]  = {m_CubeVertexBuffer, m_InstanceBuffer};
-        m_pImmediateContext->SetVertexBuffers(0, _countof(pBuffs), pBuffs, offsets, RESOURCE_STATE_TRANSITION_MODE_TRANSITION, SET_VERTEX_BUFFERS_FLAG_RESET);
-        m_pImmediateContext->SetIndexBuffer(m_CubeIndexBuffer, 0, RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+        if (m_TwoLevelInstancing)
+        {
+            // Solo el buffer de vértices: los datos por instancia se leen del buffer estructurado
+            const Uint64 offsets[] = {0};
+            IBuffer*     pBuffs[]  = {m_CubeVertexBuffer};
+            m_pImmediateContext->SetVertexBuffers(0, _countof(pBuffs), pBuffs, offsets, RESOURCE_STATE_TRANSITION_MODE_TRANSITION, SET_VERTEX_BUFFERS_FLAG_RESET);
+            m_pImmediateContext->SetIndexBuffer(m_CubeIndexBuffer, 0, RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+
+            m_pImmediateContext->SetPipelineState(m_pTwoLevelPSO);
+            m_pImmediateContext->CommitShaderResources(m_TwoLevelSRB, RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+        }
+        else
+        {
+            // Bind vertex, instance and index buffers
+            const Uint64 offsets[] = {0, 0};
+            IBuffer*     pBuffs[]  = {m_CubeVertexBuffer, m_InstancePool.GetBuffer()};
+            m_pImmediateContext->SetVertexBuffers(0, _countof(pBuffs), pBuffs, offsets, RESOURCE_STATE_TRANSITION_MODE_TRANSITION, SET_VERTEX_BUFFERS_FLAG_RESET);
+            m_pImmediateContext->SetIndexBuffer(m_CubeIndexBuffer, 0, RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
 
-        // Set the pipeline state
-        m_pImmediateContext->SetPipelineState(m_pPSO);
-        // Commit shader resources
-        m_pImmediateContext->CommitShaderResources(m_SRB, RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+            // Set the pipeline state
+            m_pImmediateContext->SetPipelineState(m_pPSO);
+            // Commit shader resources
+            m_pImmediateContext->CommitShaderResources(m_SRB, RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+        }
 
         DrawIndexedAttribs DrawAttrs;
         DrawAttrs.IndexType    = VT_UINT32;
         DrawAttrs.NumIndices   = 36;
-        DrawAttrs.NumInstances = 24; // Número de instancias del móvil
+        DrawAttrs.NumInstances = m_InstancePool.GetCount(); // Piezas de todos los móviles
+        if (m_TwoLevelInstancing)
+            DrawAttrs.NumInstances = m_MobileRootPool.GetCount() * NumMobilePieces;
         DrawAttrs.Flags = DRAW_FLAG_VERIFY_ALL;
         m_pImmediateContext->DrawIndexed(DrawAttrs);
     }
+
+    if (m_Recorder.IsRecording())
+    {
+        // La copia se hace antes de dibujar la interfaz, que no aparece en la grabación
+        m_Recorder.CaptureFrame(m_pImmediateContext, pRTV->GetTexture(), m_FrameTime);
+        // La copia deja el back buffer como origen de copia: lo volvemos a enlazar
+        m_pImmediateContext->SetRenderTargets(1, &pRTV, pDSV, RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    }
 }
 
 } // namespace Diligent
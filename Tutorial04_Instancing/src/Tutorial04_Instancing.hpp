@@ -29,8 +29,12 @@
 
 #include <string>
 #include <vector>
+#include <array>
 #include "SampleBase.hpp"
 #include "BasicMath.hpp"
+#include "InstancePool.hpp"
+#include "FrameRecorder.hpp"
+#include "InstanceBVH.hpp"
 
 namespace Diligent
 {
@@ -38,6 +42,9 @@ namespace Diligent
 class Tutorial04_Instancing final : public SampleBase
 {
 public:
+    ~Tutorial04_Instancing();
+
+    virtual void ModifyEngineInitInfo(const ModifyEngineInitInfoAttribs& Attribs) override final;
     virtual void Initialize(const SampleInitInfo& InitInfo) override final;
 
     virtual void Render() override final;
@@ -48,14 +55,31 @@ public:
 
 private:
     void CreatePipelineState();
+    void CreateTwoLevelPipelineState(IShaderSourceInputStreamFactory* pShaderSourceFactory);
     void CreateInstanceBuffer();
     void UpdateUI();
+    void UpdateRecorderUI();
     void PopulateInstanceBuffer();
+    void CreateMobileTemplate();
+    static void   ComputeTierMatrices(float MainRotation, float FirstTierRotation, float SecondTierRotation, float4x4 TierMatrices[3]);
+    static float3 GetMobileCellPosition(Uint32 Cell);
+    void UpdateMobilePieces();
+    void UpdateMobileWorldTransforms(Uint32 Cell, const float3& Position);
+    void UpdateWorldTransforms();
+
+    // Creación y eliminación de móviles en tiempo de ejecución
+    void SpawnMobile();
+    void DespawnMobile(size_t MobileIdx);
     
     // Métodos para control de cámara
     void UpdateCameraMatrices();
     void HandleMouseEvent(int x, int y, bool buttonDown, bool buttonUp, int wheel);
 
+    // Selección de piezas en la ventana 3
+    void   PickInstance(float x, float y);
+    Uint32 GetSelectedDrawIndex() const;
+    void   RunPickingBenchmark();
+
     // Estructuras para control de cámara
     struct CameraParams
     {
@@ -73,10 +97,56 @@ private:
         float ViewZoom = 0.01f; // Factor de zoom para la ventana 3
     };
     
+    // Datos por instancia (segunda ranura de vértices)
+    struct InstanceData
+    {
+        float4x4 Transform;
+        Uint32   ObjectType; // Tipo de objeto para aplicar diferentes efectos
+    };
+
+    // Pieza de la plantilla del móvil (mismo formato que MobilePiece en cube_inst_multitex.vsh)
+    struct MobilePieceTemplate
+    {
+        float4x4 Local;          // Transformación en espacio local, sin la rotación del nivel
+        Uint32   ObjectType = 0;
+        Uint32   Tier       = 0; // 0: fijo, 1: primer nivel, 2: segundo nivel
+        Uint32   Padding[2] = {};
+    };
+
+    // Registro por móvil para la instanciación en dos niveles (MobileData en el shader)
+    struct MobileData
+    {
+        float4 RootPosScale; // xyz: posición raíz, w: escala uniforme
+        float4 TierAngles;   // x: rotación principal, y: primer nivel, z: segundo nivel
+    };
+
+    // Contenido del buffer de constantes (Constants en cube_inst_multitex.vsh)
+    struct VSConstants
+    {
+        float4x4 ViewProj;
+        float4x4 Rotation;
+        uint4    Selection; // x: índice de instancia seleccionada en el dibujado actual
+    };
+
+    static constexpr Uint32 NumMobilePieces = 24;
+    using InstanceHandle                    = InstancePool<InstanceData>::Handle;
+    using MobileHandle                      = InstancePool<MobileData>::Handle;
+
+    // Cada móvil ocupa NumMobilePieces entradas del pool de instancias
+    // y un registro del pool de raíces
+    struct MobileInstance
+    {
+        float3 Position;
+        Uint32 Cell = 0; // Celda de la rejilla en la que está colocado
+
+        std::array<InstanceHandle, NumMobilePieces> Pieces;
+        MobileHandle                                Root;
+        Uint32                                      PickingGroup = InstanceBVH::InvalidGroup; // Subárbol en m_PickingBVH
+    };
+
     RefCntAutoPtr<IPipelineState>         m_pPSO;
     RefCntAutoPtr<IBuffer>                m_CubeVertexBuffer;
     RefCntAutoPtr<IBuffer>                m_CubeIndexBuffer;
-    RefCntAutoPtr<IBuffer>                m_InstanceBuffer;
     RefCntAutoPtr<IBuffer>                m_VSConstants;
     RefCntAutoPtr<ITextureView>           m_TextureSRV;
     RefCntAutoPtr<IShaderResourceBinding> m_SRB;
@@ -84,11 +154,65 @@ private:
     RefCntAutoPtr<ITextureView> m_TextureBlendSRV;    // Textura de mezcla/splatting
     RefCntAutoPtr<ITextureView> m_TextureAltSRV;      // Textura alternativa
 
+    // Instanciación en dos niveles: plantilla compartida + registros por móvil
+    RefCntAutoPtr<IPipelineState>         m_pTwoLevelPSO;
+    RefCntAutoPtr<IShaderResourceBinding> m_TwoLevelSRB;
+    RefCntAutoPtr<IBuffer>                m_MobileTemplateCB;
+
     float4x4             m_ViewProjMatrix;
-    float4x4             m_RotationMatrix;
+    float4x4             m_RotationMatrix = float4x4::Identity();
     int                  m_GridSize   = 5;
     static constexpr int MaxGridSize  = 32;
     static constexpr int MaxInstances = MaxGridSize * MaxGridSize * MaxGridSize;
+
+    // Pool de instancias que sustituye al buffer de tamaño fijo
+    InstancePool<InstanceData>  m_InstancePool;
+    std::vector<MobileInstance> m_Mobiles;
+    std::vector<Uint32>         m_FreeMobileCells;
+    Uint32                      m_NextMobileCell = 0;
+    static constexpr float      MobileSpacing    = 8.0f;
+
+    // Plantilla del móvil y piezas del móvil en espacio local, recalculadas cada fotograma
+    std::array<MobilePieceTemplate, NumMobilePieces> m_MobileTemplate;
+    std::array<InstanceData, NumMobilePieces>        m_MobilePieces;
+
+    InstancePool<MobileData> m_MobileRootPool;
+    bool                     m_TwoLevelInstancing = false;
+
+    // Transformaciones y cajas en espacio de mundo de todas las piezas, indexadas por celda
+    // (pieza i del móvil de la celda c en c * NumMobilePieces + i) para que los índices
+    // de primitiva del BVH no cambien al quitar móviles
+    std::vector<float4x4>          m_WorldTransforms;
+    std::vector<InstanceBVH::AABB> m_WorldBounds;
+    InstanceBVH                    m_PickingBVH;
+    double                         m_BVHUpdateTime = 0; // Última alta o baja de un móvil en el BVH
+    double                         m_BVHRefitTime  = 0;
+
+    // Pieza seleccionada. Los handles siguen siendo válidos aunque los pools se compacten
+    struct SelectionInfo
+    {
+        MobileHandle   Root;
+        InstanceHandle Piece;
+        Uint32         PieceIdx = 0;
+        Uint32         Cell     = 0;
+    };
+    SelectionInfo m_Selection;
+
+    struct PickingBenchmarkResult
+    {
+        Uint32 NumInstances   = 0;
+        double BuildTime      = 0; // Segundos, insertando todos los móviles
+        double UpdateTime     = 0; // Segundos, media por baja y alta de un móvil
+        double RefitTime      = 0; // Segundos, media por fotograma
+        double QueryTime      = 0; // Segundos, media por rayo
+        double BruteForceTime = 0; // Segundos, media por rayo sin BVH
+    };
+    std::vector<PickingBenchmarkResult> m_PickingBenchmark;
+
+    // Ángulos de rotación para diferentes partes
+    float m_MainRotation       = 0.0f; // Rotación principal del móvil
+    float m_FirstTierRotation  = 0.0f; // Rotación del primer nivel
+    float m_SecondTierRotation = 0.0f; // Rotación del segundo nivel
     
     // Cámaras para las tres ventanas
     CameraParams CameraWindow1; // Paneo y zoom
@@ -104,6 +228,13 @@ private:
     bool m_MouseCaptured = false;
     int m_ActiveWindow = -1; // -1: ninguna, 0: ventana 1, 1: ventana 2, 2: ventana 3
     float2 m_LastMousePos = {0.0f, 0.0f};
+
+    // Grabación de fotogramas en segundo plano
+    FrameRecorder               m_Recorder;
+    FrameRecorder::OutputFormat m_RecordFormat    = FrameRecorder::OutputFormat::PngSequence;
+    int                         m_RecordDownscale = 1;
+    double                      m_FrameTime       = 0; // Duración del último fotograma, en segundos
+    double                      m_AvgFrameTime    = 0;
 };
 
 } // namespace Diligent